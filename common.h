@@ -6,9 +6,11 @@
 #include <ctype.h>
 #include <stddef.h>
 #include <netdb.h>
+#include <time.h>
 #include "err.h"
 
 #define UDP_IPV4_DATASIZE 65507
+#define UDP_IPV4_HEADERS_SIZE 28 // IPv4 header without options and UDP header
 
 #define max(a, b)             \
 ({                           \
@@ -26,6 +28,14 @@
 
 typedef uint8_t byte;
 
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NO_DEADLINE UINT64_MAX
+
+// Maximum number of receivers the rexmit queue tracks the requests of for
+// a pack, so that it can be retransmitted to them unicast.
+#define RQ_MAX_REQUESTERS 8U
+
 struct audio_pack {
     /** id of session from which the pack came from */
     uint64_t session_id;
@@ -37,6 +47,26 @@ struct audio_pack {
     byte *audio_data;
 } __attribute__((__packed__));
 
+/**
+ * Returns current value of the monotonic clock in nanoseconds.
+ */
+inline static uint64_t monotonic_nsec() {
+    struct timespec ts;
+    CHECK_ERRNO(clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Returns current value of the coarse monotonic clock in seconds. It is
+ * read without a syscall and ticks with the scheduler, which is plenty for
+ * telling whether a station is alive.
+ */
+inline static uint64_t coarse_monotonic_sec() {
+    struct timespec ts;
+    CHECK_ERRNO(clock_gettime(CLOCK_MONOTONIC_COARSE, &ts));
+    return ts.tv_sec;
+}
+
 inline static int open_socket() {
     int socket_fd = socket(PF_INET, SOCK_DGRAM, 0);
     if (socket_fd < 0) {
@@ -93,6 +123,26 @@ inline static void bind_socket(int socket_fd, uint16_t port) {
                      (socklen_t) sizeof(server_address)));
 }
 
+/**
+ * Like create_socket(), but with SO_REUSEPORT, so that several sockets can
+ * be bound to @p port and share the unicast datagrams sent to it. Broadcast
+ * and multicast datagrams are delivered to each of them.
+ */
+inline static int create_shared_socket(uint16_t port) {
+    int socket_fd = open_socket();
+    ENSURE(socket_fd > 0);
+
+    int opt = 1;
+    CHECK_ERRNO(
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)));
+    CHECK_ERRNO(
+            setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)));
+
+    bind_socket(socket_fd, port);
+
+    return socket_fd;
+}
+
 
 inline static void start_listening(int socket_fd, size_t queue_length) {
     CHECK_ERRNO(listen(socket_fd, queue_length));
@@ -155,6 +205,22 @@ inline static void enable_multicast(int socket_fd, struct sockaddr_in
             &ip_mreq, sizeof(ip_mreq)));
 }
 
+inline static void disable_multicast(int socket_fd, struct sockaddr_in
+*mcast_addres) {
+    struct ip_mreq ip_mreq;
+    ip_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    ip_mreq.imr_multiaddr = mcast_addres->sin_addr;
+
+    CHECK_ERRNO(setsockopt(socket_fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, (void *)
+            &ip_mreq, sizeof(ip_mreq)));
+}
+
+inline static void enable_zerocopy(int socket_fd) {
+    int opt = 1;
+    CHECK_ERRNO(setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &opt,
+                           sizeof(opt)));
+}
+
 inline static in_addr_t check_address(char *addr) {
     in_addr_t in_addr;
     int res = inet_pton(AF_INET, addr, &in_addr);
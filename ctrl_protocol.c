@@ -6,10 +6,24 @@
 #include <string.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define LOOKUP_STR "ZERO_SEVEN_COME_IN"
 #define REPLY_STR "BOREWICZ_HERE"
 #define REXMIT_STR "LOUDER_PLEASE"
+#define REPAIR_STR "REPAIR"
+#define CAPS_STR "CAPS"
+#define BINARY_REXMIT_STR "BINARY_REXMIT"
+
+// REXMIT_BIN starts with REXMIT_BIN_MAGIC, the encoding of packs, three
+// zero bytes, then big-endian session_id (8 bytes), PSIZE (4 bytes) and
+// first_byte_num of the first pack requested (8 bytes).
+#define REXMIT_BIN_MAGIC "LPB1"
+#define RUNS_ENCODING 0   /**< (gap, length) varint pairs of runs of packs */
+#define BITMAP_ENCODING 1 /**< bit i set if i-th pack from the first missing */
+#define MAX_VARINT_SIZE 10
 
 int lookup_strlen = strlen(LOOKUP_STR);
 int reply_strlen = strlen(REPLY_STR);
@@ -20,44 +34,197 @@ int write_lookup(char *buf) {
 }
 
 int write_reply(char *buf, char *mcast_addr_str, uint16_t port,
-                char *sender_name) {
-    return sprintf(buf, "%s %s %d %s\n", REPLY_STR, mcast_addr_str, port,
-                   sender_name);
+                char *sender_name, char *repair_addr_str, uint32_t caps) {
+    int wrote = sprintf(buf, "%s %s %d %s\n", REPLY_STR, mcast_addr_str, port,
+                        sender_name);
+    if (repair_addr_str)
+        wrote += sprintf(buf + wrote, "%s %s\n", REPAIR_STR, repair_addr_str);
+    if (caps & CAP_BINARY_REXMIT)
+        wrote += sprintf(buf + wrote, "%s %s\n", CAPS_STR, BINARY_REXMIT_STR);
+    return wrote;
+}
+
+static const char _digit_pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+
+static uint64_t _n_digits(uint64_t value) {
+    uint64_t n = 1;
+    for (; value >= 10000; value /= 10000)
+        n += 4;
+    if (value >= 1000) return n + 3;
+    if (value >= 100) return n + 2;
+    if (value >= 10) return n + 1;
+    return n;
 }
 
-int write_rexmit(char *buf, uint64_t *packs, uint64_t n_packs) {
+/**
+ * Writes decimal @p value of @p n_digits digits to @p dst, two digits at a
+ * time from the end.
+ */
+static void _write_digits(char *dst, uint64_t value, uint64_t n_digits) {
+    char *pos = dst + n_digits;
+    while (value >= 100) {
+        pos -= 2;
+        memcpy(pos, &_digit_pairs[2 * (value % 100)], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        pos -= 2;
+        memcpy(pos, &_digit_pairs[2 * value], 2);
+    } else
+        *--pos = (char) ('0' + value);
+}
+
+int write_rexmit(char *buf, uint64_t buf_size, uint64_t *packs,
+                 uint64_t n_packs, uint64_t *n_written) {
+    uint64_t wrote = rexmit_strlen;
+    uint64_t n_digits;
+    uint64_t i;
+
+    *n_written = 0;
     if (n_packs == 0) return 0;
-    size_t wrote = sprintf(buf, "%s ", REXMIT_STR);
+    memcpy(buf, REXMIT_STR, rexmit_strlen);
 
-    for (uint64_t i = 0; i < n_packs - 1; i++)
-        wrote += sprintf(buf + wrote, "%lu,", packs[i]);
+    // Every number is preceded by a space or a comma and the last one is
+    // followed by a line break.
+    for (i = 0; i < n_packs; i++) {
+        n_digits = _n_digits(packs[i]);
+        if (wrote + n_digits + 2 > buf_size)
+            break;
+        buf[wrote++] = i == 0 ? ' ' : ',';
+        _write_digits(buf + wrote, packs[i], n_digits);
+        wrote += n_digits;
+    }
 
-    wrote += sprintf(buf + wrote, "%lu\n", packs[n_packs - 1]);
+    *n_written = i;
+    if (i == 0) return 0;
+    buf[wrote++] = '\n';
     return wrote;
 }
 
+static uint64_t _put_varint(byte *buf, uint64_t value) {
+    uint64_t size = 0;
+    while (value >= 0x80) {
+        buf[size++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buf[size++] = value;
+    return size;
+}
+
+static bool _get_varint(const byte **pos, const byte *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+        *value |= (uint64_t) (**pos & 0x7f) << shift;
+        if (!(*(*pos)++ & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Writes runs of consecutive @p packs to @p body, as many as fit.
+ * @returns size of the runs written
+ */
+static uint64_t _write_runs(byte *body, uint64_t body_size, uint64_t psize,
+                            uint64_t *packs, uint64_t n_packs,
+                            uint64_t *n_written) {
+    uint64_t size = 0;
+    uint64_t next = packs[0]; // first pack after the previous run
+    uint64_t i = 0;
+    uint64_t j;
+
+    while (i < n_packs && size + 2 * MAX_VARINT_SIZE <= body_size) {
+        for (j = i + 1; j < n_packs && packs[j] == packs[j - 1] + psize; j++)
+            ;
+        size += _put_varint(body + size, (packs[i] - next) / psize);
+        size += _put_varint(body + size, j - i);
+        next = packs[j - 1] + psize;
+        i = j;
+    }
+
+    *n_written = i;
+    return size;
+}
+
+int write_rexmit_bin(char *buf, uint64_t buf_size, uint64_t session_id,
+                     uint64_t psize, uint64_t *packs, uint64_t n_packs,
+                     uint64_t *n_written) {
+    byte *body = (byte *) buf + REXMIT_BIN_HEADER_SIZE;
+    uint64_t body_size = buf_size - REXMIT_BIN_HEADER_SIZE;
+    uint64_t runs_size;
+    uint64_t bitmap_size;
+    uint64_t be64;
+    uint32_t be32;
+    uint64_t k;
+
+    *n_written = 0;
+    if (n_packs == 0) return 0;
+
+    memcpy(buf, REXMIT_BIN_MAGIC, 4);
+    memset(buf + 4, 0, 4);
+    be64 = htobe64(session_id);
+    memcpy(buf + 8, &be64, 8);
+    be32 = htobe32(psize);
+    memcpy(buf + 16, &be32, 4);
+    be64 = htobe64(packs[0]);
+    memcpy(buf + 20, &be64, 8);
+
+    buf[4] = RUNS_ENCODING;
+    runs_size = _write_runs(body, body_size, psize, packs, n_packs, n_written);
+
+    // Scattered losses are shorter as a bit per pack from the first one to
+    // the last one.
+    bitmap_size = ((packs[n_packs - 1] - packs[0]) / psize + 8) / 8;
+    if (bitmap_size > body_size ||
+        (bitmap_size >= runs_size && *n_written == n_packs))
+        return REXMIT_BIN_HEADER_SIZE + runs_size;
+
+    buf[4] = BITMAP_ENCODING;
+    memset(body, 0, bitmap_size);
+    for (uint64_t i = 0; i < n_packs; i++) {
+        k = (packs[i] - packs[0]) / psize;
+        body[k / 8] |= 1 << (k % 8);
+    }
+
+    *n_written = n_packs;
+    return REXMIT_BIN_HEADER_SIZE + bitmap_size;
+}
+
 int what_message(char *buf) {
+    if (memcmp(buf, REXMIT_BIN_MAGIC, 4) == 0) return REXMIT_BIN;
     if (strncmp(buf, LOOKUP_STR, lookup_strlen) == 0) return LOOKUP;
     if (strncmp(buf, REPLY_STR, reply_strlen) == 0) return REPLY;
     if (strncmp(buf, REXMIT_STR, rexmit_strlen) == 0) return REXMIT;
     return -1;
 }
 
+static bool _is_mcast_addr(char *addr_str) {
+    in_addr_t in_addr;
+    return inet_pton(AF_INET, addr_str, &in_addr) > 0
+           && IN_MULTICAST(ntohl(in_addr));
+}
+
 int parse_reply(char *msg, uint64_t msg_size, char *mcast_addr_str, uint16_t
-*port, char *sender_name) {
+*port, char *sender_name, char *repair_addr_str, uint32_t *caps) {
     char *prev_token;
     char *token;
 
     char *save_ptr;
 
+    repair_addr_str[0] = '\0';
+    *caps = 0;
+    if (!memchr(msg, '\n', msg_size))
+        return -1;
+
     strtok_r(msg, " ", &save_ptr); // skip message specifier
     prev_token = strtok_r(NULL, " ", &save_ptr); // find pointer to
     // [mcast_addr] beginning
     token = strtok_r(NULL, " ", &save_ptr); // find pointer to [port] beginning
 
-    in_addr_t in_addr;
-    if (inet_pton(AF_INET, prev_token, &in_addr) <= 0
-        || !IN_MULTICAST(ntohl(in_addr)))
+    if (!prev_token || !token || !_is_mcast_addr(prev_token))
         return -1;
 
     memcpy(mcast_addr_str, prev_token, token - prev_token);
@@ -70,32 +237,161 @@ int parse_reply(char *msg, uint64_t msg_size, char *mcast_addr_str, uint16_t
     *port = read_port;
 
     token = strtok_r(NULL, "\n", &save_ptr); // get name
-    if (msg_size + msg - token > MAX_NAME_LEN) return -1;
+    if (!token || strlen(token) > MAX_NAME_LEN) return -1;
 
-    memcpy(sender_name, token, msg_size + msg - token);
+    memcpy(sender_name, token, strlen(token) + 1);
+
+    // optional lines announcing the repair group and capabilities follow
+    while ((token = strtok_r(NULL, " ", &save_ptr)) != NULL) {
+        prev_token = token;
+        token = strtok_r(NULL, "\n", &save_ptr);
+        if (!token)
+            break;
+
+        if (strcmp(prev_token, REPAIR_STR) == 0 && strlen(token) < 20 &&
+            _is_mcast_addr(token))
+            memcpy(repair_addr_str, token, strlen(token) + 1);
+        else if (strcmp(prev_token, CAPS_STR) == 0 &&
+                 strstr(token, BINARY_REXMIT_STR))
+            *caps |= CAP_BINARY_REXMIT;
+    }
 
     return 0;
 }
 
-int parse_rexmit(char *msg, uint64_t *packs, uint64_t *n_packs) {
-    char *token;
-    char *save_ptr;
+#ifdef __SSE2__
+/** Bitmask of bytes among the 16 at @p pos that are decimal digits. */
+static inline uint32_t _digits16(const char *pos) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) pos);
+    // c - '0' < 10 as unsigned bytes, as signed ones after flipping the sign
+    __m128i shifted = _mm_xor_si128(_mm_sub_epi8(chunk, _mm_set1_epi8('0')),
+                                    _mm_set1_epi8((char) 0x80));
+    return _mm_movemask_epi8(
+            _mm_cmplt_epi8(shifted, _mm_set1_epi8((char) (0x80 + 10))));
+}
+#endif
+
+/** Finds the end of the run of digits starting at @p pos. */
+static inline const char *_skip_digits(const char *pos, const char *end) {
+#ifdef __SSE2__
+    uint32_t non_digits;
+    for (; end - pos >= 16; pos += 16) {
+        non_digits = ~_digits16(pos) & 0xffff;
+        if (non_digits)
+            return pos + __builtin_ctz(non_digits);
+    }
+#endif
+    while (pos < end && (unsigned) (*pos - '0') < 10)
+        pos++;
+    return pos;
+}
+
+static inline const char *_skip_blanks(const char *pos, const char *end) {
+    while (pos < end && (*pos == ' ' || *pos == '\t'))
+        pos++;
+    return pos;
+}
+
+/**
+ * Converts the digits in [@p pos, @p end) to @p value.
+ * @returns false if the number does not fit
+ */
+static inline bool _to_uint64(const char *pos, const char *end,
+                              uint64_t *value) {
+    uint64_t digit;
+
+    *value = 0;
+    while (pos < end && *pos == '0')
+        pos++;
+    if (end - pos > 20)
+        return false;
+    for (; pos < end; pos++) {
+        digit = *pos - '0';
+        if (*value > (UINT64_MAX - digit) / 10)
+            return false;
+        *value = *value * 10 + digit;
+    }
+    return true;
+}
+
+int parse_rexmit(const char *msg, uint64_t msg_size, uint64_t *packs,
+                 uint64_t max_packs, uint64_t *n_packs) {
+    const char *end = memchr(msg, '\n', msg_size);
+    const char *pos = memchr(msg, ' ', msg_size); // skip message specifier
+    const char *digits;
+    const char *after;
 
     *n_packs = 0;
+    if (!end)
+        end = msg + msg_size;
+    if (!pos || pos > end)
+        return 0;
 
-    uint64_t byte_num;
+    // Byte numbers are separated by commas and may be surrounded by blanks.
+    // Tokens that are not a number that fits are skipped.
+    for (pos++; pos < end && *n_packs < max_packs; pos = after + 1) {
+        digits = _skip_blanks(pos, end);
+        pos = _skip_digits(digits, end);
+        after = _skip_blanks(pos, end);
+        if (pos > digits && (after == end || *after == ',') &&
+            _to_uint64(digits, pos, &packs[*n_packs]))
+            (*n_packs)++;
 
-    strtok_r(msg, " ", &save_ptr); // skip message specifier
-    token = strtok_r(NULL, ",", &save_ptr);
-    while (token != NULL) {
-        if (is_number_with_blanks(token)) {
-            errno = 0;
-            byte_num = strtoull(token, NULL, 10);
-            if (errno == 0)
-                packs[(*n_packs)++] = byte_num;
-        }
-        token = strtok_r(NULL, ",", &save_ptr);
+        after = memchr(after, ',', end - after);
+        if (!after)
+            break;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int parse_rexmit_bin(const char *msg, uint64_t msg_size, uint64_t *session_id,
+                     uint64_t *psize, uint64_t *packs, uint64_t max_packs,
+                     uint64_t *n_packs) {
+    const byte *pos = (const byte *) msg + REXMIT_BIN_HEADER_SIZE;
+    const byte *end = (const byte *) msg + msg_size;
+    uint64_t byte_num;
+    uint64_t gap;
+    uint64_t length;
+    uint64_t be64;
+    uint32_t be32;
+    byte bits;
+
+    *n_packs = 0;
+    if (msg_size < REXMIT_BIN_HEADER_SIZE ||
+        memcmp(msg, REXMIT_BIN_MAGIC, 4) != 0)
+        return -1;
+
+    memcpy(&be64, msg + 8, 8);
+    *session_id = be64toh(be64);
+    memcpy(&be32, msg + 16, 4);
+    *psize = be32toh(be32);
+    memcpy(&be64, msg + 20, 8);
+    byte_num = be64toh(be64);
+    if (*psize == 0)
+        return -1;
+
+    switch (msg[4]) {
+        case RUNS_ENCODING:
+            while (pos < end && *n_packs < max_packs) {
+                if (!_get_varint(&pos, end, &gap) ||
+                    !_get_varint(&pos, end, &length))
+                    return -1;
+                byte_num += gap * *psize;
+                for (; length > 0 && *n_packs < max_packs; length--) {
+                    packs[(*n_packs)++] = byte_num;
+                    byte_num += *psize;
+                }
+            }
+            return 0;
+        case BITMAP_ENCODING:
+            for (uint64_t i = 0; pos + i < end; i++)
+                for (bits = pos[i]; bits && *n_packs < max_packs;
+                     bits &= bits - 1)
+                    packs[(*n_packs)++] = byte_num + (i * 8 +
+                            __builtin_ctz(bits)) * *psize;
+            return 0;
+    }
+
+    return -1;
+}
@@ -8,10 +8,20 @@
 #define LOOKUP 0
 #define REPLY  1
 #define REXMIT 2
+#define REXMIT_BIN 3
+
+// Capabilities of a station announced in its REPLY.
+#define CAP_BINARY_REXMIT 1U /**< accepts REXMIT_BIN requests */
+
+// Size of REXMIT_BIN before the encoded packs.
+#define REXMIT_BIN_HEADER_SIZE 28
 
 // Define buffer size as 2^16 - a little more than maximum UDP data size
 #define CTRL_BUF_SIZE 65536
 
+// Enough for a REPLY with the longest name, a REPAIR line and all CAPS.
+#define MAX_REPLY_SIZE 256
+
 /**
  * Writes a LOOKUP message to @p buf buffer. Assumes @p buf can fit the message.
  * @param buf - destination buffer
@@ -25,48 +35,96 @@ int write_lookup(char *buf);
  * @param mcast_addr_str - string representation of station's IPv4 address
  * @param port - station's port
  * @param name - station's name
+ * @param repair_addr_str - string representation of the group to which the
+ * station retransmits packs, announced in a line of its own; NULL if it
+ * retransmits to @p mcast_addr_str
+ * @param caps - CAP_* flags of the station, announced in a line of their own
+ * if any
  * @returns written message size
  */
 int write_reply(char *buf, char *mcast_addr_str, uint16_t port,
-                char *sender_name);
+                char *sender_name, char *repair_addr_str, uint32_t caps);
 
 /**
- * Writes a REXMIT message to @p buf. Assumes @p buf can fit the message.
+ * Writes a REXMIT message to @p buf, with as many packs as fit in
+ * @p buf_size.
  * @param buf - destination buffer
+ * @param buf_size - size of @p buf, e.g. what fits in a datagram within the
+ * path MTU
  * @param packs - array of first_byte_nums of packs requested
  * @param n_packs - number of elements in @p packs
- * @returns written message size
+ * @param n_written - pointer to the number of packs written
+ * @returns written message size; 0 if not even one pack fits
  */
-int write_rexmit(char *buf, uint64_t *packs, uint64_t n_packs);
+int write_rexmit(char *buf, uint64_t buf_size, uint64_t *packs,
+                 uint64_t n_packs, uint64_t *n_written);
 
+/**
+ * Writes a REXMIT_BIN message to @p buf: the first requested pack and the
+ * following ones in units of @p psize, as runs of consecutive packs or as a
+ * bitmap, whichever is shorter. Writes as many packs as fit in @p buf_size.
+ * @param buf - destination buffer
+ * @param buf_size - size of @p buf, at least REXMIT_BIN_HEADER_SIZE + 20
+ * @param session_id - session of the packs requested
+ * @param psize - PSIZE of the session
+ * @param packs - increasing first_byte_nums of packs requested
+ * @param n_packs - number of elements in @p packs
+ * @param n_written - pointer to the number of packs written
+ * @returns written message size
+ */
+int write_rexmit_bin(char *buf, uint64_t buf_size, uint64_t session_id,
+                     uint64_t psize, uint64_t *packs, uint64_t n_packs,
+                     uint64_t *n_written);
 /**
  * Tries to establish what message is in the @p buf.
  * @param buf
- * @returns @c LOOKUP, @c REPLY, @c REXMIT if matched; -1 otherwise
+ * @returns @c LOOKUP, @c REPLY, @c REXMIT, @c REXMIT_BIN if matched; -1
+ * otherwise
  */
 int what_message(char *buf);
 
 /**
  * Parses REPLY message stored in @p msg. Stores the retrieved information in
- * @p mcast_addr_str, @p port, @p sender_name pointers.
+ * @p mcast_addr_str, @p port, @p sender_name, @p repair_addr_str pointers.
  * @param msg - message containing a valid REPLY message
  * @param msg_size - size of REPLY message
  * @param mcast_addr_str - pointer to string representation of station address
  * @param port - pointer to retrieved port
  * @param sender_name - pointer to retrieved name
+ * @param repair_addr_str - pointer to string representation of station's
+ * repair group; empty if the station does not announce one
+ * @param caps - pointer to CAP_* flags of the station
  * @returns 0 if parsed successfully; -1 if message contained incorrect data
  */
 int parse_reply(char *msg, uint64_t msg_size, char *mcast_addr_str, uint16_t
-*port, char *sender_name);
+*port, char *sender_name, char *repair_addr_str, uint32_t *caps);
 
 /**
- * Parses REXMIT message stored in @p msg.
- * @param msg - message containing a valid REPLY message
+ * Parses REXMIT message stored in @p msg in a single pass, without
+ * modifying it. Byte numbers that are not valid numbers are skipped.
+ * @param msg - message containing a REXMIT message, up to a line break
+ * @param msg_size - size of the message
  * @param packs - array of first_byte_nums of packs requested
+ * @param max_packs - size of @p packs; further packs are skipped
  * @param n_packs - number of elements in @p packs
  * @returns 0 if parsed successfully
  */
-int parse_rexmit(char *msg, uint64_t *packs, uint64_t
-*n_packs);
+int parse_rexmit(const char *msg, uint64_t msg_size, uint64_t *packs,
+                 uint64_t max_packs, uint64_t *n_packs);
+
+/**
+ * Parses REXMIT_BIN message stored in @p msg.
+ * @param msg - message containing a REXMIT_BIN message
+ * @param msg_size - size of the message
+ * @param session_id - pointer to session of the packs requested
+ * @param psize - pointer to PSIZE of the session
+ * @param packs - array of first_byte_nums of packs requested
+ * @param max_packs - size of @p packs; further packs are skipped
+ * @param n_packs - number of elements in @p packs
+ * @returns 0 if parsed successfully; -1 if message contained incorrect data
+ */
+int parse_rexmit_bin(const char *msg, uint64_t msg_size, uint64_t *session_id,
+                     uint64_t *psize, uint64_t *packs, uint64_t max_packs,
+                     uint64_t *n_packs);
 
 #endif //_CTRL_PROTOCOL_
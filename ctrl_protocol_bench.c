@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "ctrl_protocol.h"
+
+#define PSIZE 512
+#define FIRST_PACK 1000000 // byte numbers of 9 digits, some minutes in
+#define N_PACKS 5000
+#define ROUNDS 1000
+
+// Tokenizing parse_rexmit() used before, for comparison.
+int parse_rexmit_strtok(char *msg, uint64_t *packs, uint64_t *n_packs) {
+    char *token;
+    char *save_ptr;
+
+    *n_packs = 0;
+
+    uint64_t byte_num;
+
+    strtok_r(msg, " ", &save_ptr); // skip message specifier
+    token = strtok_r(NULL, ",", &save_ptr);
+    while (token != NULL) {
+        if (is_number_with_blanks(token)) {
+            errno = 0;
+            byte_num = strtoull(token, NULL, 10);
+            if (errno == 0)
+                packs[(*n_packs)++] = byte_num;
+        }
+        token = strtok_r(NULL, ",", &save_ptr);
+    }
+
+    return 0;
+}
+
+int main() {
+    char *msg = malloc(CTRL_BUF_SIZE);
+    char *buffer = malloc(CTRL_BUF_SIZE);
+    uint64_t *missing = malloc(N_PACKS * sizeof(uint64_t));
+    uint64_t *packs = malloc(CTRL_BUF_SIZE);
+    if (!msg || !buffer || !missing || !packs)
+        fatal("malloc");
+
+    // Every other pack of a burst, as receivers report them.
+    for (uint64_t i = 0; i < N_PACKS; i++)
+        missing[i] = (FIRST_PACK + 2 * i) * PSIZE;
+
+    uint64_t n_written;
+    uint64_t msg_size = write_rexmit(msg, CTRL_BUF_SIZE, missing, N_PACKS,
+                                     &n_written);
+    uint64_t n_packs = 0;
+
+    uint64_t start = monotonic_nsec();
+    for (int r = 0; r < ROUNDS; r++)
+        parse_rexmit(msg, msg_size, packs, CTRL_BUF_SIZE / sizeof(uint64_t),
+                     &n_packs);
+    uint64_t elapsed = monotonic_nsec() - start;
+
+    printf("single pass: %lu bytes, %lu packs, %lu ns/REXMIT, "
+           "%.1f ns/pack\n", msg_size, n_packs, elapsed / ROUNDS,
+           (double) elapsed / ROUNDS / N_PACKS);
+
+    // It tokenizes in place, so it gets a fresh copy, as from recvfrom(),
+    // every time.
+    start = monotonic_nsec();
+    for (int r = 0; r < ROUNDS; r++) {
+        memcpy(buffer, msg, msg_size + 1);
+        parse_rexmit_strtok(buffer, packs, &n_packs);
+    }
+    elapsed = monotonic_nsec() - start;
+
+    printf("strtok:      %lu bytes, %lu packs, %lu ns/REXMIT, "
+           "%.1f ns/pack\n", msg_size, n_packs, elapsed / ROUNDS,
+           (double) elapsed / ROUNDS / N_PACKS);
+
+    uint64_t session_id;
+    uint64_t psize;
+    msg_size = write_rexmit_bin(msg, CTRL_BUF_SIZE, 1, PSIZE, missing,
+                                N_PACKS, &n_written);
+
+    start = monotonic_nsec();
+    for (int r = 0; r < ROUNDS; r++)
+        parse_rexmit_bin(msg, msg_size, &session_id, &psize, packs,
+                         CTRL_BUF_SIZE / sizeof(uint64_t), &n_packs);
+    elapsed = monotonic_nsec() - start;
+
+    printf("binary:      %lu bytes, %lu packs, %lu ns/REXMIT, "
+           "%.1f ns/pack\n", msg_size, n_packs, elapsed / ROUNDS,
+           (double) elapsed / ROUNDS / N_PACKS);
+
+    free(msg);
+    free(buffer);
+    free(missing);
+    free(packs);
+}
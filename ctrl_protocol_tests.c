@@ -11,13 +11,78 @@ int main() {
     char mcast_addr_str[20];
     uint16_t port;
     char sender_name[65];
+    char repair_addr_str[20];
+    uint32_t caps;
 
-    parse_reply(buf, msg_size, mcast_addr_str, &port, sender_name);
+    parse_reply(buf, msg_size, mcast_addr_str, &port, sender_name,
+                repair_addr_str, &caps);
 
     assert(what_message(msg) == REPLY);
     assert(strcmp(mcast_addr_str, "233.222.111.111") == 0);
     assert(port == 4242);
     assert(strcmp(sender_name, "Radio Kapitał") == 0);
+    assert(repair_addr_str[0] == '\0');
+    assert(caps == 0);
+
+    memset(buf, 0, 200);
+    msg_size = write_reply(buf, "233.222.111.111", 4242, "Radio Kapitał",
+                           "233.222.111.112", CAP_BINARY_REXMIT);
+    memset(mcast_addr_str, 0, sizeof(mcast_addr_str));
+    memset(sender_name, 0, sizeof(sender_name));
+    parse_reply(buf, msg_size, mcast_addr_str, &port, sender_name,
+                repair_addr_str, &caps);
+
+    assert(strcmp(mcast_addr_str, "233.222.111.111") == 0);
+    assert(port == 4242);
+    assert(strcmp(sender_name, "Radio Kapitał") == 0);
+    assert(strcmp(repair_addr_str, "233.222.111.112") == 0);
+    assert(caps == CAP_BINARY_REXMIT);
+
+    // A burst of losses and a few scattered ones are written as runs.
+    char bin[REXMIT_BIN_HEADER_SIZE + 64];
+    uint64_t missing[1004];
+    uint64_t n_written;
+    uint64_t session_id;
+    uint64_t psize;
+    uint64_t n_missing;
+    for (int i = 0; i < 1000; i++)
+        missing[i] = 512 * (100 + i);
+    for (int i = 1000; i < 1004; i++)
+        missing[i] = 512 * (100000 + 7 * i);
+    msg_size = write_rexmit_bin(bin, sizeof(bin), 42, 512, missing, 1004,
+                                &n_written);
+    assert(n_written == 1004);
+    assert(msg_size < REXMIT_BIN_HEADER_SIZE + 20);
+    assert(what_message(bin) == REXMIT_BIN);
+    uint64_t *parsed = malloc(2000 * sizeof(uint64_t));
+    assert(parse_rexmit_bin(bin, msg_size, &session_id, &psize, parsed, 2000,
+                            &n_missing) == 0);
+    assert(session_id == 42 && psize == 512 && n_missing == 1004);
+    assert(memcmp(parsed, missing, sizeof(missing)) == 0);
+
+    // Every other pack lost is shorter as a bitmap.
+    for (int i = 0; i < 200; i++)
+        missing[i] = 512 * (100 + 2 * i);
+    msg_size = write_rexmit_bin(bin, sizeof(bin), 42, 512, missing, 200,
+                                &n_written);
+    assert(n_written == 200);
+    assert(msg_size == REXMIT_BIN_HEADER_SIZE + 50);
+    assert(parse_rexmit_bin(bin, msg_size, &session_id, &psize, parsed, 2000,
+                            &n_missing) == 0);
+    assert(n_missing == 200);
+    assert(memcmp(parsed, missing, 200 * sizeof(uint64_t)) == 0);
+
+    // Too many scattered losses for the buffer are cut short.
+    for (int i = 0; i < 1000; i++)
+        missing[i] = 512 * (100 + 1000 * i);
+    msg_size = write_rexmit_bin(bin, sizeof(bin), 42, 512, missing, 1000,
+                                &n_written);
+    assert(n_written > 0 && n_written < 1000);
+    assert(parse_rexmit_bin(bin, msg_size, &session_id, &psize, parsed, 2000,
+                            &n_missing) == 0);
+    assert(n_missing == n_written);
+    assert(memcmp(parsed, missing, n_written * sizeof(uint64_t)) == 0);
+    free(parsed);
 
     msg = "LOUDER_PLEASE 1,2,3,4,5,6,7,8,9,10\n";
     msg_size = strlen(msg);
@@ -27,7 +92,7 @@ int main() {
     uint64_t n_packs;
 
     assert(what_message(msg) == REXMIT);
-    parse_rexmit(buf, packs, &n_packs);
+    parse_rexmit(buf, msg_size, packs, 420, &n_packs);
 
     assert(n_packs == 10);
     for (int i = 0; i < n_packs; i++)
@@ -42,9 +107,47 @@ int main() {
     memcpy(buf, msg, msg_size);
 
     assert(what_message(msg) == REXMIT);
-    parse_rexmit(buf, packs, &n_packs);
+    parse_rexmit(buf, msg_size, packs, 420, &n_packs);
 
     assert(n_packs == 4);
-    for (int i = 0; i < n_packs; i++)
-        printf("%lu\n", packs[i]);
+    assert(packs[0] == 0 && packs[1] == 32 && packs[2] == 16 && packs[3] == 0);
+
+    // Malformed and overflowing numbers are skipped, long ones are not.
+    msg = "LOUDER_PLEASE 1 2,,x,18446744073709551616,-3,"
+          "00000000000000000000000000000000000000018446744073709551615,"
+          "1234567890123456789 ,7";
+    msg_size = strlen(msg);
+    parse_rexmit(msg, msg_size, packs, 420, &n_packs);
+
+    assert(n_packs == 3);
+    assert(packs[0] == UINT64_MAX && packs[1] == 1234567890123456789ULL &&
+           packs[2] == 7);
+
+    // Packs that do not fit are skipped.
+    parse_rexmit(msg, msg_size, packs, 2, &n_packs);
+    assert(n_packs == 2);
+
+    // A REXMIT is cut at the datagram size, the rest goes in the next one.
+    char dgram[1472];
+    uint64_t n_sent = 0;
+    for (int i = 0; i < 420; i++)
+        missing[i] = i == 0 ? 0 : i == 1 ? UINT64_MAX : 512ULL * (1000003 * i);
+    while (n_sent < 420) {
+        msg_size = write_rexmit(dgram, sizeof(dgram), missing + n_sent,
+                                420 - n_sent, &n_written);
+        assert(n_written > 0 && msg_size <= sizeof(dgram));
+        assert(dgram[msg_size - 1] == '\n');
+        assert(what_message(dgram) == REXMIT);
+        parse_rexmit(dgram, msg_size, packs, 420, &n_packs);
+        assert(n_packs == n_written);
+        assert(memcmp(packs, missing + n_sent,
+                      n_written * sizeof(uint64_t)) == 0);
+        n_sent += n_written;
+    }
+
+    // Not even one number fits.
+    assert(write_rexmit(dgram, 20, missing + 1, 1, &n_written) == 0);
+    assert(n_written == 0);
+
+    printf("ctrl_protocol_tests: OK\n");
 }
\ No newline at end of file
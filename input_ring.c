@@ -0,0 +1,102 @@
+#include <semaphore.h>
+#include <stdatomic.h>
+#include "input_ring.h"
+
+struct input_ring {
+    struct audio_pack *entries;
+    uint64_t capacity;
+
+    uint64_t head;                   /**< next entry to pop, consumer's */
+    uint64_t tail;                  /**< next entry to push, producer's */
+
+    // glibc semaphores are atomic counters, which fall back to futex waits
+    // only when they would drop below zero.
+    sem_t filled;                        /**< number of entries to pop */
+    sem_t empty;                         /**< number of free entries */
+
+    _Atomic uint64_t peak;        /**< peak occupancy since last taken */
+};
+
+input_ring *ir_init(uint64_t capacity) {
+    input_ring *ir = malloc(sizeof(input_ring));
+    if (!ir)
+        fatal("malloc");
+
+    ir->entries = calloc(capacity, sizeof(struct audio_pack));
+    if (!ir->entries)
+        fatal("calloc");
+
+    ir->capacity = capacity;
+    ir->head = ir->tail = 0;
+    atomic_init(&ir->peak, 0);
+
+    CHECK_ERRNO(sem_init(&ir->filled, 0, 0));
+    CHECK_ERRNO(sem_init(&ir->empty, 0, capacity));
+
+    return ir;
+}
+
+void ir_free(input_ring *ir) {
+    CHECK_ERRNO(sem_destroy(&ir->filled));
+    CHECK_ERRNO(sem_destroy(&ir->empty));
+    free(ir->entries);
+    free(ir);
+}
+
+void ir_push(input_ring *ir, const struct audio_pack *pack) {
+    if (!ir || !pack) fatal("null argument");
+
+    while (sem_wait(&ir->empty) != 0)
+        ENSURE(errno == EINTR);
+
+    ir->entries[ir->tail] = *pack;
+    ir->tail = (ir->tail + 1) % ir->capacity;
+
+    CHECK_ERRNO(sem_post(&ir->filled));
+
+    uint64_t occupancy = ir_occupancy(ir);
+    uint64_t peak = atomic_load(&ir->peak);
+    while (occupancy > peak &&
+           !atomic_compare_exchange_weak(&ir->peak, &peak, occupancy));
+}
+
+bool ir_pop(input_ring *ir, struct audio_pack *pack, uint64_t deadline_ns) {
+    if (!ir || !pack) fatal("null argument");
+
+    struct timespec deadline = {.tv_sec = deadline_ns / NSEC_PER_SEC,
+                                .tv_nsec = deadline_ns % NSEC_PER_SEC};
+    int res;
+
+    do {
+        if (deadline_ns == NO_DEADLINE)
+            res = sem_wait(&ir->filled);
+        else
+            res = sem_clockwait(&ir->filled, CLOCK_MONOTONIC, &deadline);
+    } while (res != 0 && errno == EINTR);
+
+    if (res != 0) {
+        ENSURE(errno == ETIMEDOUT);
+        return false;
+    }
+
+    *pack = ir->entries[ir->head];
+    ir->head = (ir->head + 1) % ir->capacity;
+
+    CHECK_ERRNO(sem_post(&ir->empty));
+
+    return true;
+}
+
+uint64_t ir_capacity(input_ring *ir) {
+    return ir->capacity;
+}
+
+uint64_t ir_occupancy(input_ring *ir) {
+    int filled;
+    CHECK_ERRNO(sem_getvalue(&ir->filled, &filled));
+    return filled > 0 ? filled : 0;
+}
+
+uint64_t ir_take_peak_occupancy(input_ring *ir) {
+    return atomic_exchange(&ir->peak, ir_occupancy(ir));
+}
@@ -0,0 +1,71 @@
+#ifndef _INPUT_RING_
+#define _INPUT_RING_
+
+#include <stdint.h>
+#include "common.h"
+
+/**
+ * A bounded single-producer/single-consumer queue of packs read from the
+ * input and waiting to be sent. Audio data of the packs is not copied: it
+ * stays in rexmit queue slots the packs were read into.
+ *
+ * Producer and consumer never share a lock. Each of them only enters the
+ * kernel if it has to wait, i.e. when the ring is full or empty
+ * respectively.
+ */
+struct input_ring;
+
+typedef struct input_ring input_ring;
+
+/**
+ * Initializes the input ring.
+ * @param capacity - maximum number of packs in the ring
+ * @returns pointer to input ring
+ */
+input_ring *ir_init(uint64_t capacity);
+
+/**
+ * Frees the input ring.
+ * @param ir - pointer to input ring
+ */
+void ir_free(input_ring *ir);
+
+/**
+ * Appends the @p pack to the ring. Blocks while the ring is full. Must be
+ * called from the producer thread only.
+ * @param ir - pointer to input ring
+ * @param pack - pack to append
+ */
+void ir_push(input_ring *ir, const struct audio_pack *pack);
+
+/**
+ * Takes the oldest pack from the ring and stores it in @p pack. Blocks while
+ * the ring is empty, but only until the monotonic clock reaches
+ * @p deadline_ns. Must be called from the consumer thread only.
+ * @param ir - pointer to input ring
+ * @param pack - pointer to the result
+ * @param deadline_ns - deadline; @c NO_DEADLINE to wait without a limit
+ * @returns true if a pack was taken; false on timeout
+ */
+bool ir_pop(input_ring *ir, struct audio_pack *pack, uint64_t deadline_ns);
+
+/**
+ * Returns the maximum number of packs in the ring.
+ * @param ir - pointer to input ring
+ */
+uint64_t ir_capacity(input_ring *ir);
+
+/**
+ * Returns the number of packs currently in the ring.
+ * @param ir - pointer to input ring
+ */
+uint64_t ir_occupancy(input_ring *ir);
+
+/**
+ * Returns the highest number of packs that were in the ring at once since
+ * the previous call.
+ * @param ir - pointer to input ring
+ */
+uint64_t ir_take_peak_occupancy(input_ring *ir);
+
+#endif //_INPUT_RING_
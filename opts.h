@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include "err.h"
 #include "common.h"
 #include "receiver_config.h"
@@ -21,11 +22,27 @@
 #define DEFAULT_FSIZE 131072
 #define DEFAULT_RTIME 250
 #define DEFAULT_NAME "Nienazwany Nadajnik"
+#define DEFAULT_BATCH_SIZE 1
+#define DEFAULT_BATCH_DELAY 10
+#define MAX_BATCH_SIZE 1024
+#define DEFAULT_INPUT_QUEUE 64
+#define MAX_STATION_ARGS 64
+#define DEFAULT_CTRL_LISTENERS 1
+#define MAX_CTRL_LISTENERS 64
+#define DEFAULT_MTU 1500
+#define MIN_MTU 576 // every IPv4 host has to accept datagrams that large
+#define MAX_MTU 65535
 
 struct sender_opts {
     /** address of targeted receiver (set with option -a, obligatory) */
     char mcast_addr_str[20];
 
+    /** group to which retransmitted packs are sent instead of the station's
+     * one, announced to receivers in REPLY (set with option -G); empty if
+     * not set
+     */
+    char repair_addr_str[20];
+
     /** data port (set with option -P) defaults to @p DATA_PORT */
     uint16_t port;
 
@@ -40,13 +57,116 @@ struct sender_opts {
      */
     uint16_t ctrl_port;
 
-    /** time reserved for gathering missing packs reports from receivers
+    /** minimum time in milliseconds between REPLYs to the same receiver;
+     * LOOKUPs it sends more often are ignored
+     * set with option -K, defaults to 0 (no limit)
+     */
+    uint64_t lookup_interval;
+
+    /** number of threads listening on the control port, each with its own
+     * SO_REUSEPORT socket (set with option -L), defaults to
+     * @p DEFAULT_CTRL_LISTENERS
+     */
+    uint64_t ctrl_listeners;
+
+    /** time reserved for gathering missing packs reports from receivers:
+     * requests are coalesced for this long before being served
      * set with option -R, defaults to @p DEFAULT_RTIME
      */
     uint64_t rtime;
 
+    /** whether to serve the first request after a quiet period at once and
+     * coalesce only the ones that follow for RTIME (set with flag -I)
+     */
+    bool rexmit_immediate;
+
+    /** time in milliseconds after retransmitting a pack during which
+     * further requests of it are ignored
+     * set with option -H, defaults to 0 (none)
+     */
+    uint64_t rexmit_holdoff;
+
+    /** cap on the retransmission rate in percent of the live byte rate;
+     * requests over the cap are put off until there is budget again
+     * set with option -X, defaults to 0 (no cap); needs -r or -s
+     */
+    uint64_t rexmit_budget;
+
+    /** maximum number of receivers that asked for a pack for it to be
+     * retransmitted to each of them unicast instead of to the group; up to
+     * RQ_MAX_REQUESTERS (set with option -u), defaults to 0 (never)
+     */
+    uint64_t unicast_threshold;
+
+    /** cap on FIFO size; if set, FIFO is resized between FSIZE and it to
+     * keep the packs receivers request (set with option -x), defaults to 0
+     * (fixed FSIZE)
+     */
+    uint64_t max_fsize;
+
+    /** file in which the FIFO is kept instead of memory, so that it may be
+     * larger than RAM and survives restarts (set with option -F); empty if
+     * not set
+     */
+    char rexmit_path[PATH_MAX];
+
     /** sender name (set with -n) defaults to @p DEFAULT_NAME */
     char sender_name[MAX_NAME_LEN + 1];
+
+    /** maximum number of packs sent with a single syscall
+     * set with option -B, defaults to @p DEFAULT_BATCH_SIZE
+     */
+    uint64_t batch_size;
+
+    /** maximum time in milliseconds a read pack may wait for its batch to
+     * fill up before being sent
+     * set with option -D, defaults to @p DEFAULT_BATCH_DELAY
+     */
+    uint64_t batch_delay;
+
+    /** whether to send live packs with MSG_ZEROCOPY (set with flag -z),
+     * which pays off for large PSIZE only
+     */
+    bool zerocopy;
+
+    /** whether to hand batches of packs to the kernel as single UDP GSO
+     * sends (set with flag -g)
+     */
+    bool gso;
+
+    /** rate in bytes per second at which live packs are sent
+     * set with option -r or derived from the audio format set with
+     * -s <sample_rate>:<channels>:<bits_per_sample>, 0 (no pacing) otherwise
+     */
+    uint64_t byte_rate;
+
+    /** number of read packs that may wait to be sent
+     * set with option -Q, defaults to @p DEFAULT_INPUT_QUEUE
+     */
+    uint64_t input_queue;
+
+    /** interval in seconds between printing statistics to STDERR
+     * set with option -m, defaults to 0 (never)
+     */
+    uint64_t stats_interval;
+
+    /** file to send instead of STDIN (set with option -i), memory-mapped
+     * if it is a regular file and read as a stream otherwise; empty if not
+     * set
+     */
+    char input_path[PATH_MAX];
+
+    /** whether to start over from the beginning of the input file after
+     * sending it (set with flag -l)
+     */
+    bool loop;
+
+    /** file with options of stations to serve from a single process, one
+     * station per line (set with option -M); empty if not set. All
+     * stations share the control port, so only -C, -K and -m are taken
+     * from the command line then.
+     */
+    char stations_path[PATH_MAX];
 };
 
 typedef struct sender_opts sender_opts;
@@ -76,6 +196,17 @@ struct receiver_opts {
     /** buffer size (set with -b) defaults to @p DEFAULT_BSIZE */
     uint64_t bsize;
 
+    /** whether the kernel may coalesce received packs with UDP GRO (set
+     * with flag -g), falling back to plain receives where unsupported
+     */
+    bool gro;
+
+    /** MTU of the path to senders; missing packs reports are split into
+     * datagrams that fit in it, so that none of them is IP-fragmented
+     * set with option -M, defaults to @p DEFAULT_MTU
+     */
+    uint64_t mtu;
+
     /** prioritized sender name (set with -n) defaults to '\0' (none) */
     char sender_name[MAX_NAME_LEN + 1];
 };
@@ -152,6 +283,23 @@ inline static int parse_port_from_opt(uint16_t *dest) {
     return 0;
 }
 
+inline static int parse_sample_format_from_opt(uint64_t *byte_rate) {
+    unsigned long sample_rate, channels, bits;
+    int n_chars = 0;
+
+    if (sscanf(optarg, "%lu:%lu:%lu%n", &sample_rate, &channels, &bits,
+               &n_chars) != 3 || optarg[n_chars] != '\0' ||
+        !isdigit(optarg[0]) || sample_rate == 0 || channels == 0 ||
+        bits == 0 || bits % 8 != 0) {
+        fprintf(stderr,
+                "Invalid audio format (expected rate:channels:bits): %s\n",
+                optarg);
+        return 1;
+    }
+    *byte_rate = sample_rate * channels * (bits / 8);
+    return 0;
+}
+
 inline static sender_opts *get_sender_opts(int argc, char **argv) {
     sender_opts *opts = malloc(sizeof(sender_opts));
 
@@ -159,8 +307,27 @@ inline static sender_opts *get_sender_opts(int argc, char **argv) {
     opts->port = DATA_PORT;
     sprintf(opts->sender_name, "%s", DEFAULT_NAME);
     opts->ctrl_port = CTRL_PORT;
+    opts->ctrl_listeners = DEFAULT_CTRL_LISTENERS;
+    opts->lookup_interval = 0;
     opts->rtime = DEFAULT_RTIME;
+    opts->rexmit_immediate = false;
+    opts->rexmit_holdoff = 0;
+    opts->rexmit_budget = 0;
+    opts->unicast_threshold = 0;
+    memset(opts->repair_addr_str, 0, sizeof(opts->repair_addr_str));
     opts->fsize = DEFAULT_FSIZE;
+    opts->max_fsize = 0;
+    memset(opts->rexmit_path, 0, sizeof(opts->rexmit_path));
+    opts->batch_size = DEFAULT_BATCH_SIZE;
+    opts->batch_delay = DEFAULT_BATCH_DELAY;
+    opts->zerocopy = false;
+    opts->gso = false;
+    opts->byte_rate = 0;
+    opts->input_queue = DEFAULT_INPUT_QUEUE;
+    opts->stats_interval = 0;
+    memset(opts->input_path, 0, sizeof(opts->input_path));
+    opts->loop = false;
+    memset(opts->stations_path, 0, sizeof(opts->stations_path));
 
     int aflag = 0;
     int errflag = 0;
@@ -169,19 +336,53 @@ inline static sender_opts *get_sender_opts(int argc, char **argv) {
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "a:n:p:P:C:R:f:")) != -1) {
+    while ((c = getopt(argc, argv, "a:G:n:p:P:C:L:K:R:IH:X:u:f:x:F:B:D:zgr:s:Q:m:i:lM:")) != -1) {
         switch (c) {
             case 'a':
                 aflag = 1;
                 errflag |= parse_string_from_opt(opts->mcast_addr_str, sizeof
                         (opts->mcast_addr_str));
                 break;
+            case 'G':
+                errflag |= parse_string_from_opt(opts->repair_addr_str, sizeof
+                        (opts->repair_addr_str));
+                break;
             case 'C':
                 errflag |= parse_port_from_opt(&opts->ctrl_port);
                 break;
+            case 'L':
+                errflag |= parse_num_from_opt(&opts->ctrl_listeners, true);
+                if (opts->ctrl_listeners > MAX_CTRL_LISTENERS) {
+                    fprintf(stderr,
+                            "Number of control listeners larger than %d: %lu\n",
+                            MAX_CTRL_LISTENERS, opts->ctrl_listeners);
+                    errflag = 1;
+                }
+                break;
+            case 'K':
+                errflag |= parse_num_from_opt(&opts->lookup_interval, false);
+                break;
             case 'R':
                 errflag |= parse_num_from_opt(&opts->rtime, true);
                 break;
+            case 'I':
+                opts->rexmit_immediate = true;
+                break;
+            case 'H':
+                errflag |= parse_num_from_opt(&opts->rexmit_holdoff, false);
+                break;
+            case 'X':
+                errflag |= parse_num_from_opt(&opts->rexmit_budget, true);
+                break;
+            case 'u':
+                errflag |= parse_num_from_opt(&opts->unicast_threshold, false);
+                if (opts->unicast_threshold > RQ_MAX_REQUESTERS) {
+                    fprintf(stderr,
+                            "Unicast threshold larger than %u: %lu\n",
+                            RQ_MAX_REQUESTERS, opts->unicast_threshold);
+                    errflag = 1;
+                }
+                break;
             case 'n':
                 errflag |= parse_name_from_opt(opts->sender_name,
                                                MAX_NAME_LEN);
@@ -199,13 +400,66 @@ inline static sender_opts *get_sender_opts(int argc, char **argv) {
             case 'f':
                 errflag |= parse_num_from_opt(&opts->fsize, false);
                 break;
+            case 'x':
+                errflag |= parse_num_from_opt(&opts->max_fsize, false);
+                break;
+            case 'F':
+                errflag |= parse_string_from_opt(opts->rexmit_path,
+                                                 sizeof(opts->rexmit_path) - 1);
+                break;
             case 'P':
                 errflag |= parse_port_from_opt(&opts->port);
                 break;
+            case 'B':
+                errflag |= parse_num_from_opt(&opts->batch_size, true);
+                if (opts->batch_size > MAX_BATCH_SIZE) {
+                    fprintf(stderr,
+                            "Batch size larger than %d: %lu\n",
+                            MAX_BATCH_SIZE, opts->batch_size);
+                    errflag = 1;
+                }
+                break;
+            case 'D':
+                errflag |= parse_num_from_opt(&opts->batch_delay, false);
+                break;
+            case 'z':
+                opts->zerocopy = true;
+                break;
+            case 'g':
+                opts->gso = true;
+                break;
+            case 'r':
+                errflag |= parse_num_from_opt(&opts->byte_rate, true);
+                break;
+            case 's':
+                errflag |= parse_sample_format_from_opt(&opts->byte_rate);
+                break;
+            case 'Q':
+                errflag |= parse_num_from_opt(&opts->input_queue, true);
+                break;
+            case 'm':
+                errflag |= parse_num_from_opt(&opts->stats_interval, false);
+                break;
+            case 'i':
+                errflag |= parse_string_from_opt(opts->input_path,
+                                                 sizeof(opts->input_path) - 1);
+                break;
+            case 'l':
+                opts->loop = true;
+                break;
+            case 'M':
+                errflag |= parse_string_from_opt(opts->stations_path,
+                                                 sizeof(opts->stations_path) - 1);
+                break;
             case '?':
-                if (optopt == 'a' || optopt == 'p' ||
+                if (optopt == 'a' || optopt == 'G' || optopt == 'p' ||
                     optopt == 'P' || optopt == 'n' || optopt == 'C' ||
-                    optopt == 'R' || optopt == 'f')
+                    optopt == 'R' || optopt == 'f' || optopt == 'B' ||
+                    optopt == 'D' || optopt == 'r' || optopt == 's' ||
+                    optopt == 'Q' || optopt == 'm' || optopt == 'i' ||
+                    optopt == 'M' || optopt == 'H' || optopt == 'X' ||
+                    optopt == 'u' || optopt == 'F' || optopt == 'x' ||
+                    optopt == 'L' || optopt == 'K')
                     fprintf(stderr, "Option -%c requires an argument.\n",
                             optopt);
                 else if (isprint(optopt))
@@ -221,9 +475,25 @@ inline static sender_opts *get_sender_opts(int argc, char **argv) {
         }
     }
 
-    if (aflag == 0) {
+    if (aflag == 0 && opts->stations_path[0] == '\0') {
         fprintf(stderr, "Usage: ./sikradio-sender "
-                        "-a <mcast_addr>\n");
+                        "-a <mcast_addr> | -M <stations_file>\n");
+        errflag = 1;
+    }
+
+    if (opts->max_fsize > 0 && opts->max_fsize < opts->fsize) {
+        fprintf(stderr, "FIFO cap (-x) is smaller than FIFO size (-f).\n");
+        errflag = 1;
+    }
+
+    if (opts->rexmit_budget > 0 && opts->byte_rate == 0) {
+        fprintf(stderr, "Retransmission budget (-X) requires a rate "
+                        "(-r or -s).\n");
+        errflag = 1;
+    }
+
+    if (opts->loop && opts->input_path[0] == '\0') {
+        fprintf(stderr, "Looping (-l) requires a file to send (-i).\n");
         errflag = 1;
     }
 
@@ -244,6 +514,8 @@ inline static receiver_opts *get_receiver_opts(int argc, char **argv) {
     opts->rtime = DEFAULT_RTIME;
     sprintf(opts->discover_addr, "%s", DISCOVER_ADDR);
     opts->ui_port = UI_PORT;
+    opts->mtu = DEFAULT_MTU;
+    opts->gro = false;
     opts->sender_name[0] = '\0';
 
     int errflag = 0;
@@ -252,7 +524,7 @@ inline static receiver_opts *get_receiver_opts(int argc, char **argv) {
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "n:b:d:C:R:U:")) != -1) {
+    while ((c = getopt(argc, argv, "n:b:d:C:R:U:M:g")) != -1) {
         switch (c) {
             case 'd':
                 errflag |= parse_string_from_opt(opts->discover_addr, sizeof
@@ -272,13 +544,25 @@ inline static receiver_opts *get_receiver_opts(int argc, char **argv) {
             case 'b':
                 errflag |= parse_num_from_opt(&opts->bsize, true);
                 break;
+            case 'g':
+                opts->gro = true;
+                break;
+            case 'M':
+                errflag |= parse_num_from_opt(&opts->mtu, true);
+                if (opts->mtu < MIN_MTU || opts->mtu > MAX_MTU) {
+                    fprintf(stderr, "MTU must be between %d and %d: %s\n",
+                            MIN_MTU, MAX_MTU, optarg);
+                    errflag = 1;
+                }
+                break;
             case 'n':
                 errflag |= parse_name_from_opt(opts->sender_name,
                                                MAX_NAME_LEN);
                 break;
             case '?':
                 if (optopt == 'b' || optopt == 'd' || optopt == 'C' ||
-                    optopt == 'R' || optopt == 'U' || optopt == 'n')
+                    optopt == 'R' || optopt == 'U' || optopt == 'n' ||
+                    optopt == 'M')
                     fprintf(stderr, "Option -%c requires an argument.\n",
                             optopt);
                 else if (isprint(optopt))
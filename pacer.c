@@ -0,0 +1,58 @@
+#include "pacer.h"
+
+/**
+ * Returns the time it takes to send @p bytes at the rate of the pacer,
+ * avoiding overflow of the intermediate product.
+ */
+static uint64_t _duration_ns(pacer *p, uint64_t bytes) {
+    return bytes / p->byte_rate * NSEC_PER_SEC +
+           bytes % p->byte_rate * NSEC_PER_SEC / p->byte_rate;
+}
+
+/**
+ * Returns the time at which the next byte is due according to the schedule.
+ */
+static uint64_t _due_ns(pacer *p) {
+    return p->base_ns + _duration_ns(p, p->sent_bytes - p->base_bytes);
+}
+
+void pacer_init(pacer *p, uint64_t byte_rate, uint64_t burst) {
+    if (!p || byte_rate == 0) fatal("invalid argument");
+
+    p->byte_rate = byte_rate;
+    p->burst_ns = 0; // so that _duration_ns() is usable below
+    p->burst_ns = _duration_ns(p, burst);
+
+    p->base_ns = monotonic_nsec();
+    p->base_bytes = p->sent_bytes = 0;
+}
+
+uint64_t pacer_ready_ns(pacer *p) {
+    uint64_t due = _due_ns(p);
+    return due > p->burst_ns ? due - p->burst_ns : 0;
+}
+
+void pacer_wait(pacer *p) {
+    uint64_t ready = pacer_ready_ns(p);
+    struct timespec ts = {.tv_sec = ready / NSEC_PER_SEC,
+                          .tv_nsec = ready % NSEC_PER_SEC};
+    int res;
+
+    do {
+        res = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    } while (res == EINTR);
+    CHECK(res);
+}
+
+void pacer_consume(pacer *p, uint64_t bytes) {
+    uint64_t now = monotonic_nsec();
+
+    if (_due_ns(p) + p->burst_ns < now) {
+        // The stream fell behind by more than a burst, e.g. input stalled.
+        // Move the schedule forward instead of catching up at full speed.
+        p->base_ns = now - p->burst_ns;
+        p->base_bytes = p->sent_bytes;
+    }
+
+    p->sent_bytes += bytes;
+}
@@ -0,0 +1,52 @@
+#ifndef _PACER_
+#define _PACER_
+
+#include <stdint.h>
+#include "common.h"
+
+/**
+ * Token bucket spreading sends of a stream evenly over time. The schedule is
+ * anchored at an absolute point in time, so sleeping late does not make the
+ * stream drift: the time lost is made up for by sending up to @p burst bytes
+ * ahead of schedule.
+ */
+struct pacer {
+    uint64_t byte_rate;                   /**< target rate in bytes/second */
+    uint64_t burst_ns;       /**< time it takes to send a burst of bytes */
+
+    uint64_t base_ns;           /**< time at which @p base_bytes were due */
+    uint64_t base_bytes;
+    uint64_t sent_bytes;        /**< bytes sent since the pacer started */
+};
+
+typedef struct pacer pacer;
+
+/**
+ * Initializes the pacer.
+ * @param p - pointer to pacer
+ * @param byte_rate - target rate in bytes per second
+ * @param burst - maximum number of bytes sent at once ahead of schedule
+ */
+void pacer_init(pacer *p, uint64_t byte_rate, uint64_t burst);
+
+/**
+ * Returns the value of the monotonic clock from which the next send is
+ * allowed.
+ * @param p - pointer to pacer
+ */
+uint64_t pacer_ready_ns(pacer *p);
+
+/**
+ * Blocks until the next send is allowed.
+ * @param p - pointer to pacer
+ */
+void pacer_wait(pacer *p);
+
+/**
+ * Accounts @p bytes that were just sent.
+ * @param p - pointer to pacer
+ * @param bytes - number of bytes sent
+ */
+void pacer_consume(pacer *p, uint64_t bytes);
+
+#endif //_PACER_
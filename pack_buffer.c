@@ -1,38 +1,49 @@
 #include "pack_buffer.h"
 #include <pthread.h>
-#include <assert.h>
 
 struct pack_buffer {
-    byte *buf;                                        /**< data buffer */
-    byte *buf_end;                             /**< end of data buffer */
+    // Pack seq is kept in slot (seq & slot_mask) of the data buffer. Slots
+    // are a power of two in number, so they take up less than 2 * bsize.
+    byte *buf;
+    uint64_t bsize;
 
-    bool *is_present;    /**< indicates whether i-th pack is in buffer */
+    // Bit (seq & slot_mask) is set if pack seq is present. Only the bits
+    // of the packs from the tail to the head mean anything: the head
+    // clears the slots it moves over.
+    uint64_t *present;
+    uint64_t n_words;            /**< number of words allocated in present */
 
-    uint64_t capacity;      /**< maximum number of items in the buffer */
     uint64_t psize;
-    byte *head;                            /**< pointer to buffer head */
-    uint64_t head_byte_num;                /**< first_byte_num of head */
-    uint64_t byte_zero;                   /**< current session's byte0 */
-    byte *tail;                            /**< pointer to buffer tail */
+    uint64_t capacity;         /**< maximum number of packs in the buffer */
+    uint64_t slot_mask;
+
+    // Packs are numbered with seq = (first_byte_num - base) / psize.
+    uint64_t base;                  /**< first_byte_num of session's seq 0 */
+    uint64_t head_seq;                        /**< pack after the newest */
+    uint64_t tail_seq;                                /**< oldest pack */
+    uint64_t zero_seq;                      /**< pack of current BYTE0 */
 
     pthread_mutex_t mutex;
     pthread_cond_t byte_zero_wait;
     pthread_cond_t init_wait;
 };
 
+#define WORD_BITS 64
+
 pack_buffer *pb_init(uint64_t bsize) {
     pack_buffer *pb = malloc(sizeof(pack_buffer));
+    if (!pb)
+        fatal("malloc");
 
-    pb->buf = malloc(bsize);
+    pb->buf = malloc(2 * bsize);
     if (pb->buf == NULL)
         fatal("malloc");
 
-    pb->is_present = malloc(bsize);
-    pb->buf_end = (byte *) pb->buf + bsize;
-    pb->capacity = bsize;
-    pb->psize = 0;
-    pb->head = pb->tail = pb->buf;
-    pb->head_byte_num = pb->byte_zero = 0;
+    pb->bsize = bsize;
+    pb->present = NULL;
+    pb->n_words = 0;
+    pb->psize = pb->capacity = pb->slot_mask = 0;
+    pb->base = pb->head_seq = pb->tail_seq = pb->zero_seq = 0;
 
     CHECK_ERRNO(pthread_mutex_init(&pb->mutex, NULL));
     CHECK_ERRNO(pthread_cond_init(&pb->byte_zero_wait, NULL));
@@ -41,29 +52,82 @@ pack_buffer *pb_init(uint64_t bsize) {
     return pb;
 }
 
-static void _reset_buffer(pack_buffer *pb, uint64_t byte_zero) {
-    memset(pb->buf, 0, pb->capacity);
-    memset(pb->is_present, 0, pb->capacity);
+inline static byte *_slot_data(pack_buffer *pb, uint64_t seq) {
+    return pb->buf + (seq & pb->slot_mask) * pb->psize;
+}
 
-    pb->buf_end = (byte *) pb->buf + pb->capacity;
-    pb->head_byte_num = pb->byte_zero = byte_zero;
-    pb->head = pb->tail = pb->buf;
+inline static bool _is_present(pack_buffer *pb, uint64_t seq) {
+    uint64_t slot = seq & pb->slot_mask;
+    return (pb->present[slot / WORD_BITS] >> (slot % WORD_BITS)) & 1;
+}
+
+/**
+ * @returns how many of @p n slots from @p slot on share its word of
+ * the presence bitmap
+ */
+inline static uint64_t _run_length(pack_buffer *pb, uint64_t slot,
+                                   uint64_t n) {
+    n = min(n, WORD_BITS - slot % WORD_BITS);
+    return min(n, pb->slot_mask + 1 - slot);
+}
+
+/** @returns mask of @p n bits of the word of @p slot from its bit on */
+inline static uint64_t _bit_range(uint64_t slot, uint64_t n) {
+    return (n == WORD_BITS ? ~0ULL : (1ULL << n) - 1) << (slot % WORD_BITS);
+}
+
+/** Marks packs [@p from_seq, @p to_seq) as not present. */
+static void _clear_slots(pack_buffer *pb, uint64_t from_seq, uint64_t to_seq) {
+    uint64_t slot;
+    uint64_t n;
+
+    if (to_seq - from_seq > pb->slot_mask) {
+        memset(pb->present, 0, pb->n_words * sizeof(uint64_t));
+        return;
+    }
+
+    while (from_seq < to_seq) {
+        slot = from_seq & pb->slot_mask;
+        n = _run_length(pb, slot, to_seq - from_seq);
+        pb->present[slot / WORD_BITS] &= ~_bit_range(slot, n);
+        from_seq += n;
+    }
+}
+
+static void _reset_buffer(pack_buffer *pb, uint64_t psize, uint64_t byte_zero) {
+    uint64_t n_slots = 1;
+    uint64_t n_words;
+
+    pb->psize = psize;
+    pb->capacity = pb->bsize / psize;
+    while (n_slots < pb->capacity)
+        n_slots *= 2;
+    pb->slot_mask = n_slots - 1;
+
+    // Data of packs that are not present is never read, so only their
+    // presence is cleared.
+    n_words = (n_slots + WORD_BITS - 1) / WORD_BITS;
+    if (n_words > pb->n_words) {
+        free(pb->present);
+        pb->present = malloc(n_words * sizeof(uint64_t));
+        if (!pb->present)
+            fatal("malloc");
+    }
+    pb->n_words = n_words;
+    memset(pb->present, 0, n_words * sizeof(uint64_t));
+
+    pb->base = byte_zero;
+    pb->head_seq = pb->tail_seq = pb->zero_seq = 0;
 }
 
 void pb_reset(pack_buffer *pb, uint64_t psize, uint64_t byte_zero) {
     if (!pb) fatal("null argument");
     CHECK_ERRNO(pthread_mutex_lock(&pb->mutex));
-    _reset_buffer(pb, byte_zero);
-    pb->psize = psize;
+    _reset_buffer(pb, psize, byte_zero);
     CHECK_ERRNO(pthread_cond_signal(&pb->init_wait));
     CHECK_ERRNO(pthread_mutex_unlock(&pb->mutex));
 }
 
-inline static void _handle_buf_end_overlap(byte **pos, pack_buffer *pb) {
-    if (*pos + pb->psize > pb->buf_end)
-        *pos = pb->buf;
-}
-
 void pb_find_missing(pack_buffer *pb, uint64_t *n_packs,
                      uint64_t **missing_buf, uint64_t *buf_size) {
     if (!pb) fatal("null argument");
@@ -72,40 +136,34 @@ void pb_find_missing(pack_buffer *pb, uint64_t *n_packs,
     while (pb->psize == 0)
         CHECK_ERRNO(pthread_cond_wait(&pb->init_wait, &pb->mutex));
 
-    size_t exp_size = sizeof(uint64_t) * pb->capacity / pb->psize;
+    size_t exp_size = sizeof(uint64_t) * pb->capacity;
 
-    if (*buf_size != exp_size) {
+    if (*buf_size < exp_size) {
         *missing_buf = realloc(*missing_buf, exp_size);
         if (!(*missing_buf))
             fatal("realloc");
         *buf_size = exp_size;
     }
 
-    byte *pos = pb->tail;
-    uint64_t missing_byte_num;
-    uint64_t shift = 0;
-
     uint64_t last = 0;
-
-    while (pos != pb->head) {
-        if (!pb->is_present[pos - pb->buf]) {
-            if (pos >= pb->head)
-                // Fix relative missing package number in case it is on the
-                // right end of the buffer.
-                shift = pb->buf - pb->buf_end;
-
-            missing_byte_num = pb->head_byte_num - (pb->head - shift - pos);
-
-            if (missing_byte_num < pb->head_byte_num &&
-                missing_byte_num > pb->byte_zero)
-                (*missing_buf)[last++] = missing_byte_num;
-
+    uint64_t seq = max(pb->tail_seq, pb->zero_seq + 1);
+    uint64_t slot;
+    uint64_t n;
+    uint64_t missing;
+
+    // A word of the bitmap at a time.
+    while (seq < pb->head_seq) {
+        slot = seq & pb->slot_mask;
+        n = _run_length(pb, slot, pb->head_seq - seq);
+        missing = ~pb->present[slot / WORD_BITS] & _bit_range(slot, n);
+
+        while (missing) {
+            (*missing_buf)[last++] = pb->base + pb->psize *
+                    (seq + __builtin_ctzll(missing) - slot % WORD_BITS);
+            missing &= missing - 1;
         }
 
-        pos += pb->psize;
-
-        if (pb->head != pb->buf_end)
-            _handle_buf_end_overlap(&pos, pb);
+        seq += n;
     }
 
     CHECK_ERRNO(pthread_mutex_unlock(&pb->mutex));
@@ -113,138 +171,96 @@ void pb_find_missing(pack_buffer *pb, uint64_t *n_packs,
     *n_packs = last;
 }
 
-/**
- * Wipes the buffer contents while updating the pack counter and is_present
- * table in the pack buffer.
- * @param pb - pointer to pack buffer
- * @param ptr - memory area in the buffer from which to wipe @p bytes
- * @param bytes - number of bytes to wipe
- */
-static void _wipe_buffer(pack_buffer *pb, byte *ptr, size_t bytes) {
-    if (ptr + bytes > pb->buf_end)
-        bytes -= ptr + bytes - pb->buf_end;
-
-    memset(ptr, 0, bytes);
-    uint64_t pos = ptr - pb->buf;
-    assert(pos % pb->psize == 0);
-    memset(pb->is_present + pos, 0, bytes);
-}
-
-inline static void _add_pack(pack_buffer *pb, byte *ptr, const byte *pack) {
-    memcpy(ptr, pack, pb->psize);
-    pb->is_present[ptr - pb->buf] = true;
-}
-
-static void
-_handle_buffer_overflow(pack_buffer *pb, uint64_t missing, const byte *pack) {
-    // How many bytes left till the buffer end from current head.
-    uint64_t bytes_to_end = pb->buf_end - pb->head;
-
-    _wipe_buffer(pb, pb->head, bytes_to_end); // Wipe from head to end.
-
-    // How many slots left till the buffer end from current head.
-    // Important to introduce such value, since pb->size doesn't
-    // need to be divisible by pb->psize.
-    uint64_t packs_to_end = bytes_to_end / pb->psize;
-
-    // Reserve space for the rest of missing packages that land
-    // in the buffer beginning and new head.
-    _wipe_buffer(pb, pb->buf, missing - packs_to_end * pb->psize + pb->psize);
-
-    // Place the pack in its new spot.
-    byte *prev_head = pb->head;
+static void _insert_pack_into_buffer(pack_buffer *pb, uint64_t first_byte_num,
+                                     const byte *pack) {
+    if (pb->capacity == 0 || first_byte_num < pb->base ||
+        (first_byte_num - pb->base) % pb->psize != 0)
+        return; // does not fit, or not a pack of this session
+
+    uint64_t seq = (first_byte_num - pb->base) / pb->psize;
+
+    if (seq < pb->tail_seq) {
+        return; // played already or too old to fit
+    } else if (seq >= pb->head_seq) {
+        // The packs in between are missing. The oldest packs are dropped
+        // if the new ones do not fit.
+        _clear_slots(pb, pb->head_seq, seq);
+        pb->head_seq = seq + 1;
+        if (pb->head_seq - pb->tail_seq > pb->capacity)
+            pb->tail_seq = pb->head_seq - pb->capacity;
+    } else if (_is_present(pb, seq)) {
+        return;
+    }
 
-    pb->head = pb->buf + missing - packs_to_end * pb->psize;
-    _add_pack(pb, pb->head, pack);
-    pb->head += pb->psize;
+    byte *ptr = _slot_data(pb, seq);
+    if (ptr != pack) // unless received in place
+        memcpy(ptr, pack, pb->psize);
 
-    if ((pb->head >= pb->tail && prev_head >= pb->tail)
-        || (pb->head <= pb->tail && prev_head <= pb->tail)) {
-        // Head overlapped the tail.
-        pb->tail = pb->head + pb->psize;
-        _handle_buf_end_overlap(&pb->tail, pb);
-    }
+    uint64_t slot = seq & pb->slot_mask;
+    pb->present[slot / WORD_BITS] |= 1ULL << (slot % WORD_BITS);
 }
 
-static uint64_t _range(pack_buffer *pb) {
-    if (pb->tail <= pb->head) return pb->head - pb->tail;
-    else return pb->capacity + pb->head - pb->tail;
+/**
+ * @returns whether packs from BYTE0 on fill 3/4 of the buffer, so that
+ * playback can start
+ */
+inline static bool _is_filled_enough(pack_buffer *pb) {
+    return (pb->head_seq - pb->zero_seq) * pb->psize >= pb->bsize / 4 * 3;
 }
 
-static void _insert_pack_into_buffer(pack_buffer *pb, uint64_t first_byte_num,
-                                     const byte *pack) {
-    // How many space to reserve in bytes for missing packs, if any.
-    // Overflow warning: first_byte_num may be less than pb->head_byte_num.
-    uint64_t missing = first_byte_num - pb->head_byte_num;
-
-    if (pb->head_byte_num > first_byte_num) {
-        // Encountered a missing pack.
-        if (pb->head_byte_num - first_byte_num <= _range(pb)) {
-            byte *ptr = pb->head - pb->head_byte_num + first_byte_num;
+uint64_t pb_reserve(pack_buffer *pb, uint64_t n, byte **slots,
+                    uint64_t *first_byte_num, uint64_t *psize) {
+    if (!pb || !slots) fatal("null argument");
+    CHECK_ERRNO(pthread_mutex_lock(&pb->mutex));
 
-            if (ptr < pb->buf) // Left overlap
-                ptr += pb->capacity / pb->psize * pb->psize;
+    uint64_t n_reserved = 0;
 
-            _add_pack(pb, ptr, pack);
-        } // else: Encountered a missing, but ancient package... ignore.
-        return;
-    } else if (missing > pb->capacity) {
-        // This won't fit. Reset the buffer.
-        missing = (pb->capacity / pb->psize - 1) * pb->psize;
-        _reset_buffer(pb, first_byte_num - missing);
-        _add_pack(pb, pb->head + missing, pack);
-        pb->head = pb->head + missing + pb->psize;
-    } else if (pb->head + missing >= pb->buf_end)
-        // Buffer overflow.
-        _handle_buffer_overflow(pb, missing, pack);
-    else {
-        if (pb->head < pb->tail && pb->tail <= pb->head + missing + pb->psize) {
-            // Tail overlap.
-            _wipe_buffer(pb, pb->head, missing + 2 * pb->psize);
-            pb->tail = pb->head + missing + 2 * pb->psize;
-            _handle_buf_end_overlap(&pb->tail, pb);
-        }
+    if (pb->capacity > 0) {
+        // Slots of the packs from the tail to the head hold packs waiting
+        // to be played, the rest are free.
+        n_reserved = min(n, pb->slot_mask + 1 -
+                            (pb->head_seq - pb->tail_seq));
+        for (uint64_t i = 0; i < n_reserved; i++)
+            slots[i] = _slot_data(pb, pb->head_seq + i);
 
-        // Insert normally.
-        _add_pack(pb, pb->head + missing, pack);
-        pb->head = pb->head + missing + pb->psize;
+        *first_byte_num = pb->base + pb->head_seq * pb->psize;
+        *psize = pb->psize;
     }
 
-    pb->head_byte_num = first_byte_num + pb->psize;
-    _handle_buf_end_overlap(&pb->head, pb);
-}
-
-inline static bool _is_in_buffer(pack_buffer *pb, uint64_t first_byte_num) {
-    if (pb->head_byte_num < first_byte_num) return false;
-
-    uint64_t head_pos = pb->head - pb->buf;
-    uint64_t dist_from_head = pb->head_byte_num - first_byte_num;
-
-    if (head_pos < dist_from_head) return false;
+    CHECK_ERRNO(pthread_mutex_unlock(&pb->mutex));
 
-    return pb->is_present[head_pos - dist_from_head];
+    return n_reserved;
 }
 
 void pb_push_back(pack_buffer *pb, uint64_t first_byte_num, const byte *pack,
                   uint64_t psize) {
-    if (!pb) fatal("null argument");
-    if (pb->psize != psize) return;
+    pb_pack entry = {.first_byte_num = first_byte_num, .data = pack};
+    pb_push_back_batch(pb, &entry, 1, psize);
+}
+
+void pb_push_back_batch(pack_buffer *pb, const pb_pack *packs,
+                        uint64_t n_packs, uint64_t psize) {
+    if (!pb || !packs) fatal("null argument");
+    if (pb->psize != psize || n_packs == 0) return;
     CHECK_ERRNO(pthread_mutex_lock(&pb->mutex));
 
-    if (!_is_in_buffer(pb, first_byte_num))
-        _insert_pack_into_buffer(pb, first_byte_num, pack);
+    for (uint64_t i = 0; i < n_packs; i++)
+        _insert_pack_into_buffer(pb, packs[i].first_byte_num, packs[i].data);
 
-    if (pb->head_byte_num - pb->byte_zero >= pb->capacity / 4 * 3)
+    if (_is_filled_enough(pb))
         CHECK_ERRNO(pthread_cond_signal(&pb->byte_zero_wait));
 
     CHECK_ERRNO(pthread_mutex_unlock(&pb->mutex));
 }
 
 inline static void _take_pack_if_present(pack_buffer *pb, void *item) {
-    if (pb->is_present[pb->tail - pb->buf]) {
-        memcpy(item, pb->tail, pb->psize);
-        pb->is_present[pb->tail - pb->buf] = false;
-    } // else: just play silence
+    uint64_t slot = pb->tail_seq & pb->slot_mask;
+
+    if (_is_present(pb, pb->tail_seq)) {
+        memcpy(item, _slot_data(pb, pb->tail_seq), pb->psize);
+        pb->present[slot / WORD_BITS] &= ~(1ULL << (slot % WORD_BITS));
+    } else // just play silence
+        memset(item, 0, pb->psize);
     /*
      * NOTE: just playing silence does not comply with the requirements, which
      * say that if the pack is not found, the playback should be stopped
@@ -254,23 +270,19 @@ inline static void _take_pack_if_present(pack_buffer *pb, void *item) {
      * ignore this requirement for the sake of better listening experience.
      */
 
-    if (pb->head != pb->tail) {
-        pb->tail += pb->psize;
-        _handle_buf_end_overlap(&pb->tail, pb);
-    }
+    pb->tail_seq++;
 }
 
 uint64_t pb_pop_front(pack_buffer *pb, void *item) {
     if (!pb) fatal("null argument");
     CHECK_ERRNO(pthread_mutex_lock(&pb->mutex));
 
-    while (pb->head == pb->tail ||
-           pb->head_byte_num - pb->byte_zero < pb->capacity / 4 * 3) {
-        if (pb->head == pb->tail)
+    while (pb->head_seq == pb->tail_seq || !_is_filled_enough(pb)) {
+        if (pb->head_seq == pb->tail_seq)
             // Buffer is depleted. We will wait for it to fill up
             // to approx. 75% to avoid unstable playback.
-            pb->byte_zero = pb->head_byte_num;
-        // else: Stop playback until (BYTE0 + 3/4 * PSIZE)'th byte received.
+            pb->zero_seq = pb->head_seq;
+        // else: Stop playback until (BYTE0 + 3/4 * BSIZE)'th byte received.
         CHECK_ERRNO(pthread_cond_wait(&pb->byte_zero_wait, &pb->mutex));
     }
 
@@ -9,8 +9,18 @@ struct pack_buffer;
 
 typedef struct pack_buffer pack_buffer;
 
+/** A pack to insert with pb_push_back_batch(). */
+struct pb_pack {
+    uint64_t first_byte_num;
+    const byte *data;
+};
+
+typedef struct pb_pack pb_pack;
+
 /**
- * Initializes the pack buffer. Returns a pointer to struct.
+ * Initializes the pack buffer. Returns a pointer to struct. The buffer
+ * holds as many packs as fit in @p bsize bytes, in a ring of a power of
+ * two slots, so it takes up to 2 * @p bsize bytes.
  * @param bsize - size of pack buffer in bytes
  */
 pack_buffer *pb_init(uint64_t bsize);
@@ -38,12 +48,43 @@ void pb_reset(pack_buffer *pb, uint64_t psize, uint64_t byte_zero);
 void pb_push_back(pack_buffer *pb, uint64_t first_byte_num, const byte *pack,
                   uint64_t psize);
 
+/**
+ * Reserves up to @p n slots for the packs expected to come next, so that
+ * they can be received right into the buffer. The i-th slot is for the
+ * pack @p first_byte_num + i * @p psize. Only slots that hold no packs to
+ * be played are reserved. Packs received into their slots are inserted
+ * with pb_push_back_batch() without being copied. The reservation lasts
+ * until the next push or reset, so only the thread pushing packs may
+ * reserve slots.
+ * @param pb - pointer to pack buffer
+ * @param n - maximum number of slots to reserve
+ * @param slots - array of at least @p n pointers to the slots' data
+ * @param first_byte_num - pointer to the number of the first slot's pack
+ * @param psize - pointer to PSIZE of the slots
+ * @returns number of slots reserved; 0 if the buffer has no session yet
+ */
+uint64_t pb_reserve(pack_buffer *pb, uint64_t n, byte **slots,
+                    uint64_t *first_byte_num, uint64_t *psize);
+
+/**
+ * Inserts @p packs into the buffer like pb_push_back() does, with a single
+ * lock acquisition and at most one wakeup of the reader for all of them.
+ * Packs whose data is already in their slots, see pb_reserve(), are not
+ * copied. Does nothing in case @p psize differs from @p pb->psize.
+ * @param pb - pointer to pack buffer
+ * @param packs - array of packs
+ * @param n_packs - number of elements in @p packs
+ * @param psize - size of each pack's data in bytes
+ */
+void pb_push_back_batch(pack_buffer *pb, const pb_pack *packs,
+                        uint64_t n_packs, uint64_t psize);
+
 /**
  * Pops oldest pack from the pack buffer @p pb and stores it in @p item.
  * Blocks if pack buffer @p pb is empty or haven't received a pack with
- * byte_num at least @p 0.75*pb->size apart from @p pb->byte_zero.
+ * byte_num at least 0.75 * BSIZE apart from BYTE0.
  *
- * If unable to take a pack from the buffer, it leaves @p item unchanged.
+ * If the oldest pack never came, @p item is filled with silence instead.
  * @param pb - pointer to pack buffer
  * @param item - result buffer
  * @returns psize of back buffer @p pb
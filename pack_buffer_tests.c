@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "pack_buffer.h"
+
+#define PSIZE 4
+#define CAPACITY 100 // packs; the buffer has 128 slots
+#define BYTE_ZERO 1000
+
+static void push(pack_buffer *pb, uint64_t seq) {
+    byte pack[PSIZE];
+
+    memset(pack, (int) seq + 1, PSIZE);
+    pb_push_back(pb, BYTE_ZERO + seq * PSIZE, pack, PSIZE);
+}
+
+// Pops a pack and checks it is all @p expected bytes.
+static void pop(pack_buffer *pb, byte expected) {
+    byte pack[PSIZE];
+
+    assert(pb_pop_front(pb, pack) == PSIZE);
+    for (int i = 0; i < PSIZE; i++)
+        assert(pack[i] == expected);
+}
+
+int main() {
+    pack_buffer *pb = pb_init(CAPACITY * PSIZE);
+    uint64_t *missing = NULL;
+    uint64_t buf_size = 0;
+    uint64_t n_packs;
+
+    pb_reset(pb, PSIZE, BYTE_ZERO);
+
+    // Gaps in the first and the second word of the presence bitmap.
+    for (uint64_t seq = 0; seq < 90; seq++)
+        if (seq != 3 && (seq < 60 || seq >= 70))
+            push(pb, seq);
+
+    pb_find_missing(pb, &n_packs, &missing, &buf_size);
+    assert(n_packs == 11);
+    assert(missing[0] == BYTE_ZERO + 3 * PSIZE);
+    for (uint64_t i = 1; i < n_packs; i++)
+        assert(missing[i] == BYTE_ZERO + (59 + i) * PSIZE);
+
+    // Packs already present and packs off the session's grid are ignored.
+    byte other[PSIZE] = {0xAA, 0xAA, 0xAA, 0xAA};
+    pb_push_back(pb, BYTE_ZERO + 5 * PSIZE, other, PSIZE);
+    pb_push_back(pb, BYTE_ZERO + 3 * PSIZE + 1, other, PSIZE);
+    pb_push_back(pb, BYTE_ZERO + 3 * PSIZE, other, 2 * PSIZE);
+
+    for (uint64_t seq = 0; seq < 10; seq++)
+        pop(pb, seq == 3 ? 0 : seq + 1);
+
+    // The newest packs push the oldest ones out of the ring.
+    for (uint64_t seq = 90; seq < 230; seq++)
+        push(pb, seq);
+    push(pb, 50);
+
+    pb_find_missing(pb, &n_packs, &missing, &buf_size);
+    assert(n_packs == 0);
+    pop(pb, 130 + 1);
+
+    // Packs received into reserved slots are inserted in place.
+    byte *slots[64];
+    uint64_t first_byte_num;
+    uint64_t psize;
+    uint64_t n_slots = pb_reserve(pb, 64, slots, &first_byte_num, &psize);
+    assert(n_slots == 128 - (230 - 131));
+    assert(first_byte_num == BYTE_ZERO + 230 * PSIZE && psize == PSIZE);
+
+    memset(slots[0], 0x55, PSIZE);
+    memset(slots[2], 0x66, PSIZE);
+    pb_pack packs[] = {{first_byte_num, slots[0]},
+                       {first_byte_num + 2 * PSIZE, slots[2]}};
+    pb_push_back_batch(pb, packs, 2, PSIZE);
+
+    pb_find_missing(pb, &n_packs, &missing, &buf_size);
+    assert(n_packs == 1 && missing[0] == BYTE_ZERO + 231 * PSIZE);
+
+    for (uint64_t seq = 133; seq < 230; seq++)
+        pop(pb, seq + 1);
+    pop(pb, 0x55);
+    pop(pb, 0);
+    pop(pb, 0x66);
+
+    // A jump further than the whole ring.
+    push(pb, 1000);
+    pb_find_missing(pb, &n_packs, &missing, &buf_size);
+    assert(n_packs == CAPACITY - 1);
+    assert(missing[0] == BYTE_ZERO + 901 * PSIZE);
+    assert(missing[n_packs - 1] == BYTE_ZERO + 999 * PSIZE);
+
+    // A new session with other PSIZE.
+    pb_reset(pb, 2 * PSIZE, 0);
+    push(pb, 0);
+    byte pack[2 * PSIZE] = {0};
+    pb_push_back(pb, 5 * 2 * PSIZE, pack, 2 * PSIZE);
+
+    pb_find_missing(pb, &n_packs, &missing, &buf_size);
+    assert(n_packs == 4);
+    for (uint64_t i = 0; i < n_packs; i++)
+        assert(missing[i] == (i + 1) * 2 * PSIZE);
+
+    free(missing);
+
+    printf("pack_buffer_tests: OK\n");
+}
@@ -11,19 +11,26 @@
 #include "receiver_ui.h"
 #include "receiver_utils.h"
 
-static void *pack_receiver(void *args) {
-    receiver_data *rd = args;
+// Number of reports of missing packs without any after which the repair group
+// is left. Joining and leaving costs IGMP traffic, so it is not done for
+// every passing gap.
+#define REPAIR_LINGER_ROUNDS 8
 
-    uint64_t psize;
+// Maximum number of datagrams of a missing packs report sent with a single
+// syscall.
+#define REXMIT_BATCH_SIZE 64
 
-    struct audio_pack *pack = malloc(sizeof(struct audio_pack));
-    size_t read_length;
+static void *pack_receiver(void *args) {
+    receiver_data *rd = args;
 
     int socket_fd = -1;
 
-    byte *buffer = malloc(rd->bsize);
-    if (!buffer)
-        fatal("malloc");
+    data_batch *db = db_init();
+    uint64_t n_dgrams;
+    uint64_t address;
+    uint64_t published_address = 0;
+    uint64_t now_sec;
+    uint64_t bumped_sec = 0;
 
     struct sockaddr_in station_addr;
 
@@ -32,20 +39,52 @@ static void *pack_receiver(void *args) {
 
     while (true) {
         if (st_switch_if_changed(rd->st, &curr_station)) {
+            CHECK_ERRNO(pthread_mutex_lock(&rd->repair_mutex));
             if (socket_fd > 0)
                 CHECK_ERRNO(close(socket_fd));
 
             inet_aton(curr_station.mcast_addr, &station_addr.sin_addr);
             socket_fd = create_timeoutable_socket(curr_station.port);
             enable_multicast(socket_fd, &station_addr);
+            if (rd->gro)
+                db_enable_gro(db, socket_fd);
             rd->last_session_id = 0;
+
+            // Repairs arrive on the same port, so the socket just joins the
+            // repair group as well while it has gaps to fill.
+            rd->data_socket_fd = socket_fd;
+            rd->has_repair = curr_station.repair_addr[0] != '\0';
+            if (rd->has_repair)
+                inet_aton(curr_station.repair_addr,
+                          &rd->repair_addr.sin_addr);
+            rd->in_repair = false;
+            CHECK_ERRNO(pthread_mutex_unlock(&rd->repair_mutex));
+
+            atomic_store(&rd->binary_rexmit,
+                         (curr_station.caps & CAP_BINARY_REXMIT) != 0);
+        }
+
+        n_dgrams = db_recv(db, socket_fd, rd->pb);
+        if (n_dgrams == 0)
+            continue;
+
+        // Nothing is locked on the way unless the sender moves or a second
+        // passes.
+        address = pack_address(&db->addrs[n_dgrams - 1]);
+        if (address != published_address) {
+            atomic_store(&rd->sender_address, address);
+            published_address = address;
         }
 
-        read_length = receive_pack(socket_fd, &pack, buffer, &psize, rd);
+        now_sec = coarse_monotonic_sec();
+        if (now_sec != bumped_sec) {
+            st_bump_current_station(rd->st, now_sec);
+            bumped_sec = now_sec;
+        }
 
-        if (read_length > 0)
-            pb_push_back(rd->pb, be64toh(pack->first_byte_num),
-                         pack->audio_data, psize);
+        db_take_packs(db, rd, n_dgrams);
+        pb_push_back_batch(rd->pb, db->packs, db->n_packs,
+                           atomic_load(&rd->played_psize));
     }
 
     return 0;
@@ -61,7 +100,6 @@ static void *pack_printer(void *args) {
     uint64_t psize;
 
     while (true) {
-        memset(write_buffer, 0, rd->bsize);
         psize = pb_pop_front(rd->pb, write_buffer);
         fwrite(write_buffer, psize, sizeof(byte), stdout);
     }
@@ -75,48 +113,48 @@ static void *missing_reporter(void *args) {
     int send_sock_fd = open_socket();
     bind_socket(send_sock_fd, 0); // bind to any port
 
-    char *write_buffer = malloc(UDP_IPV4_DATASIZE);
-    if (!write_buffer)
-        fatal("malloc");
+    rexmit_batch *rb = rb_init(REXMIT_BATCH_SIZE, rd->mtu);
+    struct sockaddr_in sender_address;
 
     uint64_t n_packs_total = 0;
-    uint64_t n_packs_to_send;
     uint64_t n_packs_sent = 0;
 
-    int wrote_size;
-    ssize_t sent_size;
-    int flags = 0;
-
     uint64_t *missing_buf = NULL;
     uint64_t buf_size = 0;
 
+    uint64_t rounds_without_gaps = 0;
+    uint64_t address;
+
     st_wait_until_station_found(rd->st);
 
     while (true) {
         pb_find_missing(rd->pb, &n_packs_total, &missing_buf,
                         &buf_size);
 
-        if (n_packs_total > 0)
-            while (n_packs_total > n_packs_sent) {
-                n_packs_to_send = min(n_packs_total - n_packs_sent,
-                                      UDP_IPV4_DATASIZE / sizeof(uint64_t));
-
-                wrote_size = write_rexmit(write_buffer,
-                                          missing_buf + n_packs_sent,
-                                          n_packs_to_send);
-                n_packs_sent += n_packs_to_send;
-
-                CHECK_ERRNO(pthread_mutex_lock(&rd->mutex));
-                rd->client_address.sin_port = htons(rd->ctrl_port);
-
-                errno = 0;
-                sent_size = sendto(send_sock_fd, write_buffer, wrote_size,
-                                   flags, (struct sockaddr *)
-                                           &rd->client_address,
-                                   rd->client_address_len);
-                CHECK_ERRNO(pthread_mutex_unlock(&rd->mutex));
-                ENSURE(sent_size == wrote_size);
-            }
+        // The repair group is joined before the first report of a gap
+        // goes out, so that no repair is multicast to it before the join.
+        if (n_packs_total > 0) {
+            rounds_without_gaps = 0;
+            rd_set_repair(rd, true);
+        } else if (++rounds_without_gaps == REPAIR_LINGER_ROUNDS) {
+            rd_set_repair(rd, false);
+        }
+
+        address = atomic_load(&rd->sender_address);
+        if (address == 0)
+            n_packs_total = 0; // no one to ask yet
+        else
+            unpack_address(address, &sender_address);
+        sender_address.sin_port = htons(rd->ctrl_port);
+
+        while (n_packs_total > n_packs_sent) {
+            n_packs_sent += rb_add(rb, atomic_load(&rd->binary_rexmit),
+                                   atomic_load(&rd->played_session_id),
+                                   atomic_load(&rd->played_psize),
+                                   missing_buf + n_packs_sent,
+                                   n_packs_total - n_packs_sent);
+            rb_flush(rb, send_sock_fd, &sender_address);
+        }
         n_packs_sent = 0;
         usleep(rd->rtime_u);
     }
@@ -100,7 +100,8 @@ static void _sort_stations(stations *st) {
 }
 
 void
-st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name) {
+st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name,
+          char *repair_addr_str, uint32_t caps) {
     if (!st) fatal("null argument");
     CHECK_ERRNO(pthread_mutex_lock(&st->mutex));
 
@@ -129,7 +130,10 @@ st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name) {
                  _str_compare(mcast_addr_str, st->data[i]->mcast_addr) == 0
                  && _str_compare(name, st->data[i]->name) == 0) {
             // station rediscovered, just update activity time
-            st->data[i]->last_heard = time(NULL);
+            st->data[i]->last_heard = coarse_monotonic_sec();
+            snprintf(st->data[i]->repair_addr, sizeof(st->data[i]->repair_addr),
+                     "%s", repair_addr_str);
+            st->data[i]->caps = caps;
             found = true;
         }
     }
@@ -141,8 +145,11 @@ st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name) {
 
         station *curr = st->data[empty];
         memcpy(curr->mcast_addr, mcast_addr_str, strlen(mcast_addr_str));
+        snprintf(curr->repair_addr, sizeof(curr->repair_addr), "%s",
+                 repair_addr_str);
         curr->port = port;
-        curr->last_heard = time(NULL);
+        curr->caps = caps;
+        curr->last_heard = coarse_monotonic_sec();
         memcpy(curr->name, name, strlen(name));
         st->count++;
 
@@ -255,7 +262,7 @@ void st_delete_inactive_stations(stations *st, uint64_t inactivity_sec) {
         CHECK_ERRNO(pthread_cond_wait(&st->wait_for_change, &st->mutex));
 
     if (st->count > 0) {
-        uint64_t now = time(NULL);
+        uint64_t now = coarse_monotonic_sec();
         uint64_t prev_count = st->count;
         for (size_t i = 0; i < prev_count; i++)
             if (now - st->data[i]->last_heard >=
@@ -280,9 +287,11 @@ void st_wait_until_station_found(stations *st) {
     CHECK_ERRNO(pthread_mutex_unlock(&st->mutex));
 }
 
-void st_bump_current_station(stations *st) {
+void st_bump_current_station(stations *st, uint64_t now_sec) {
     CHECK_ERRNO(pthread_mutex_lock(&st->mutex));
-    st->current->last_heard = time(NULL);
+    // The station may have been deleted in the meantime.
+    if (st->current)
+        st->current->last_heard = now_sec;
     CHECK_ERRNO(pthread_mutex_unlock(&st->mutex));
 }
 
@@ -408,6 +417,8 @@ void *station_discoverer(void *args) {
     socklen_t sender_addr_len = (socklen_t) sizeof(sender_addr);
 
     char mcast_addr_str[20];
+    char repair_addr_str[20];
+    uint32_t caps;
     uint16_t sender_port;
     char sender_name[MAX_NAME_LEN + 1];
 
@@ -433,9 +444,9 @@ void *station_discoverer(void *args) {
             if (what_message(write_buffer) == REPLY &&
                 parse_reply(write_buffer, recv_size, mcast_addr_str,
                             &sender_port,
-                            sender_name) != -1)
+                            sender_name, repair_addr_str, &caps) != -1)
                 st_update(rd->st, mcast_addr_str, sender_port,
-                          sender_name);
+                          sender_name, repair_addr_str, caps);
 
             memset(mcast_addr_str, 0, sizeof(mcast_addr_str));
             memset(sender_name, 0, sizeof(sender_name));
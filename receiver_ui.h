@@ -12,8 +12,10 @@ typedef struct stations stations;
 struct station {
     char name[MAX_NAME_LEN + 1];
     char mcast_addr[20];
+    char repair_addr[20]; /**< group of retransmissions; empty if the same */
     uint16_t port;
-    uint64_t last_heard;
+    uint32_t caps;        /**< CAP_* flags announced by the station */
+    uint64_t last_heard;  /**< coarse_monotonic_sec() it was last heard at */
 };
 typedef struct station station;
 
@@ -29,9 +31,13 @@ stations *init_stations();
  * @param mcast_addr_str - string representation of station's IPv4 address
  * @param port - station's port
  * @param name - station's name
+ * @param repair_addr_str - string representation of station's repair group;
+ * empty if it has none
+ * @param caps - CAP_* flags announced by the station
  */
 void
-st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name);
+st_update(stations *st, char *mcast_addr_str, uint16_t port, char *name,
+          char *repair_addr_str, uint32_t caps);
 
 /**
  * Deletes stations, which information was not updated for longer than @p
@@ -96,8 +102,9 @@ void st_prioritize_name(stations *st, char *station_name);
  * station in time (i.e. due to package loss) and when it is obvious that the
  * station is active, because we receive audio from it.
  * @param st - pointer to stations struct
+ * @param now_sec - current coarse_monotonic_sec()
  */
-void st_bump_current_station(stations *st);
+void st_bump_current_station(stations *st, uint64_t now_sec);
 
 /**
  * UI manager thread function. Handles TCP connections on the UI_PORT,
@@ -17,7 +17,7 @@ int main() {
     station *new;
 
     for (int i = 0; i < 3; i++) {
-        st_update(st, mcast_addr_strs[i], ports[i], names[i]);
+        st_update(st, mcast_addr_strs[i], ports[i], names[i], "", 0);
 
         st_switch_if_changed(st, &new);
 
@@ -26,7 +26,7 @@ int main() {
         printf("%s", buf);
     }
     for (int i = 0; i < 3; i++) {
-        st_update(st, mcast_addr_strs[i], ports[i], names[i]);
+        st_update(st, mcast_addr_strs[i], ports[i], names[i], "", 0);
 
         st_switch_if_changed(st, &new);
 
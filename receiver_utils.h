@@ -4,16 +4,20 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
 #include "err.h"
 #include "common.h"
 #include "pack_buffer.h"
 #include "receiver_ui.h"
 #include "opts.h"
+#include "ctrl_protocol.h"
 #include "receiver_utils.h"
 
 struct receiver_data {
-    uint64_t curr_session_id;
     uint64_t last_session_id;
 
     pack_buffer *pb;
@@ -21,16 +25,34 @@ struct receiver_data {
     uint16_t ui_port;
     uint64_t bsize;
     uint64_t rtime_u;
+    uint64_t mtu;
+    bool gro;
     struct sockaddr_in discover_addr;
 
     char *prioritized_name;
 
     stations *st;
 
-    struct sockaddr_in client_address;
-    socklen_t client_address_len;
+    // Socket the current station's packs are received through and its
+    // repair group. The reporter of missing packs joins the group itself,
+    // before asking for repairs, so that they do not come before the join.
+    // The receiving thread takes the mutex only to replace the socket.
+    pthread_mutex_t repair_mutex;
+    int data_socket_fd;                  /**< -1 until a station is played */
+    bool has_repair;
+    struct sockaddr_in repair_addr;
+    bool in_repair;                   /**< whether the group is joined */
 
-    pthread_mutex_t mutex;
+    // Session and PSIZE of the packs played and whether their station takes
+    // REXMIT_BIN, for the reports of missing packs.
+    _Atomic uint64_t played_session_id;
+    _Atomic uint64_t played_psize;
+    atomic_bool binary_rexmit;
+
+    /** address of the station's sender, see pack_address(); 0 until a
+     * pack is received. Published by the receiving thread when it changes.
+     */
+    _Atomic uint64_t sender_address;
 };
 
 typedef struct receiver_data receiver_data;
@@ -44,20 +66,60 @@ inline static receiver_data *rd_init(int argc, char **argv) {
     rd->discover_addr = parse_host_and_port(opts->discover_addr,
                                             opts->ctrl_portstr);
     rd->rtime_u = opts->rtime * 1000; // microseconds
+    rd->mtu = opts->mtu;
+    rd->gro = opts->gro;
     rd->ui_port = opts->ui_port;
     rd->pb = pb_init(rd->bsize);
     rd->st = init_stations();
 
     rd->prioritized_name = opts->sender_name;
 
-    rd->client_address_len = (socklen_t) sizeof(rd->client_address);
     rd->last_session_id = 0;
-
-    CHECK_ERRNO(pthread_mutex_init(&rd->mutex, NULL));
+    CHECK_ERRNO(pthread_mutex_init(&rd->repair_mutex, NULL));
+    rd->data_socket_fd = -1;
+    rd->has_repair = rd->in_repair = false;
+    atomic_init(&rd->played_session_id, 0);
+    atomic_init(&rd->played_psize, 0);
+    atomic_init(&rd->binary_rexmit, false);
+    atomic_init(&rd->sender_address, 0);
 
     return rd;
 }
 
+/**
+ * Joins the current station's repair group if @p joined is set and leaves
+ * it otherwise. Does nothing if the station has no repair group.
+ */
+inline static void rd_set_repair(receiver_data *rd, bool joined) {
+    CHECK_ERRNO(pthread_mutex_lock(&rd->repair_mutex));
+
+    if (rd->has_repair && rd->in_repair != joined) {
+        if (joined)
+            enable_multicast(rd->data_socket_fd, &rd->repair_addr);
+        else
+            disable_multicast(rd->data_socket_fd, &rd->repair_addr);
+        rd->in_repair = joined;
+    }
+
+    CHECK_ERRNO(pthread_mutex_unlock(&rd->repair_mutex));
+}
+
+/**
+ * Packs IPv4 address and port of @p addr into a single word, so that it can
+ * be published atomically. Never 0 for a real address.
+ */
+inline static uint64_t pack_address(const struct sockaddr_in *addr) {
+    return (uint64_t) addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+/** Unpacks an address packed with pack_address() into @p addr. */
+inline static void unpack_address(uint64_t packed, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = packed >> 16;
+    addr->sin_port = packed & 0xffff;
+}
+
 /**
  * Writes a telnet negotiation to descriptor @p fd using a buffer @p buf in
  * order to disable telnet's linemode and make it send every keystroke
@@ -94,43 +156,357 @@ inline static void handle_input(char *nav_buffer, stations *st) {
         }
 }
 
-inline static size_t receive_pack(int socket_fd, struct audio_pack **pack, byte
-*buffer,
-                                  uint64_t *psize, receiver_data *rd) {
-    ssize_t read_length;
-    int flags = 0;
-    errno = 0;
+// Maximum number of datagrams received with a single syscall.
+#define RECV_BATCH_SIZE 32
+
+// Maximum number of datagrams coalesced by UDP GRO into a single one.
+#define GRO_MAX_SEGS 64
+
+#define RECV_CMSG_SIZE CMSG_SPACE(sizeof(int))
+
+/**
+ * Datagrams of a station received with one recvmmsg() call, and the packs
+ * of the played session they carry. Without UDP GRO, headers are received
+ * apart from audio data, which goes right into the pack buffer slots
+ * reserved for the packs expected next, and into the datagram's buffer
+ * otherwise.
+ */
+struct data_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;       /**< up to 3 per datagram */
+    byte *bufs;     /**< RECV_BATCH_SIZE buffers of UDP_IPV4_DATASIZE bytes */
+    byte *headers;            /**< RECV_BATCH_SIZE headers of 16 bytes */
+    struct sockaddr_in *addrs;
+    char *cmsgs;      /**< UDP GRO segment sizes; NULL if GRO is not used */
+
+    byte **slots;             /**< pack buffer slots reserved for receiving */
+    uint64_t n_slots;
+    uint64_t slots_first_byte_num;
+    uint64_t slots_psize;
+    bool slots_valid;         /**< false once the pack buffer was reset */
+
+    pb_pack *packs;
+    uint64_t n_packs;
+};
+
+typedef struct data_batch data_batch;
+
+inline static data_batch *db_init() {
+    data_batch *db = malloc(sizeof(data_batch));
+    if (!db)
+        fatal("malloc");
+
+    db->msgs = calloc(RECV_BATCH_SIZE, sizeof(struct mmsghdr));
+    db->iovs = calloc(3 * RECV_BATCH_SIZE, sizeof(struct iovec));
+    db->bufs = malloc(RECV_BATCH_SIZE * UDP_IPV4_DATASIZE);
+    db->headers = malloc(RECV_BATCH_SIZE * 16);
+    db->addrs = calloc(RECV_BATCH_SIZE, sizeof(struct sockaddr_in));
+    db->slots = calloc(RECV_BATCH_SIZE, sizeof(byte *));
+    db->packs = calloc(RECV_BATCH_SIZE * GRO_MAX_SEGS, sizeof(pb_pack));
+    if (!db->msgs || !db->iovs || !db->bufs || !db->headers || !db->addrs ||
+        !db->slots || !db->packs)
+        fatal("calloc");
+    db->cmsgs = NULL;
+    db->n_slots = 0;
+    db->n_packs = 0;
+
+    for (uint64_t i = 0; i < RECV_BATCH_SIZE; i++) {
+        db->msgs[i].msg_hdr.msg_iov = &db->iovs[3 * i];
+        db->msgs[i].msg_hdr.msg_name = &db->addrs[i];
+    }
+
+    return db;
+}
+
+/**
+ * Lets the kernel coalesce packs received through @p socket_fd with UDP
+ * GRO. Receives go on without it if the kernel does not support it.
+ * Coalesced packs are split in the datagram's buffer, so they are copied
+ * into the pack buffer.
+ */
+inline static void db_enable_gro(data_batch *db, int socket_fd) {
+    int opt = 1;
+
+    if (setsockopt(socket_fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) != 0) {
+        free(db->cmsgs);
+        db->cmsgs = NULL;
+        return;
+    }
+    if (!db->cmsgs)
+        db->cmsgs = calloc(RECV_BATCH_SIZE, RECV_CMSG_SIZE);
+    if (!db->cmsgs)
+        fatal("calloc");
+}
+
+/**
+ * Points the @p i-th message of the batch at the memory its datagram is
+ * to be received into.
+ */
+inline static void db_set_iovs(data_batch *db, uint64_t i) {
+    struct iovec *iov = db->msgs[i].msg_hdr.msg_iov;
+    byte *buf = db->bufs + i * UDP_IPV4_DATASIZE;
+
+    if (db->cmsgs) {
+        iov[0] = (struct iovec) {buf, UDP_IPV4_DATASIZE};
+        db->msgs[i].msg_hdr.msg_iovlen = 1;
+        return;
+    }
+
+    iov[0] = (struct iovec) {db->headers + i * 16, 16};
+    if (i < db->n_slots) {
+        // Whatever does not fit in the slot lands after its place in the
+        // buffer, so the whole audio data can be put together there.
+        iov[1] = (struct iovec) {db->slots[i], db->slots_psize};
+        iov[2] = (struct iovec) {buf + db->slots_psize,
+                                 UDP_IPV4_DATASIZE - 16 - db->slots_psize};
+        db->msgs[i].msg_hdr.msg_iovlen = 3;
+    } else {
+        iov[1] = (struct iovec) {buf, UDP_IPV4_DATASIZE - 16};
+        db->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+}
+
+/**
+ * Waits for datagrams on @p socket_fd for as long as its receive timeout
+ * and receives the ones that came, up to RECV_BATCH_SIZE, into the slots
+ * of @p pb reserved for the packs expected next where possible.
+ * @returns number of datagrams received
+ */
+inline static uint64_t db_recv(data_batch *db, int socket_fd,
+                               pack_buffer *pb) {
+    int res;
+
+    db->n_slots = db->cmsgs ? 0 : pb_reserve(pb, RECV_BATCH_SIZE, db->slots,
+                                             &db->slots_first_byte_num,
+                                             &db->slots_psize);
+    db->slots_valid = true;
+
+    for (uint64_t i = 0; i < RECV_BATCH_SIZE; i++) {
+        db_set_iovs(db, i);
+        db->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        db->msgs[i].msg_hdr.msg_control =
+                db->cmsgs ? db->cmsgs + i * RECV_CMSG_SIZE : NULL;
+        db->msgs[i].msg_hdr.msg_controllen = db->cmsgs ? RECV_CMSG_SIZE : 0;
+    }
+
+    res = recvmmsg(socket_fd, db->msgs, RECV_BATCH_SIZE, MSG_WAITFORONE, NULL);
+    return res > 0 ? res : 0;
+}
+
+/**
+ * @returns size of the datagrams the @p i-th received one was coalesced
+ * from by UDP GRO; its whole size if it was not
+ */
+inline static uint64_t db_segment_size(data_batch *db, uint64_t i) {
+    struct cmsghdr *cmsg;
+    int segment_size;
+
+    if (db->cmsgs)
+        for (cmsg = CMSG_FIRSTHDR(&db->msgs[i].msg_hdr); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&db->msgs[i].msg_hdr, cmsg))
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                memcpy(&segment_size, CMSG_DATA(cmsg), sizeof(segment_size));
+                return segment_size;
+            }
+
+    return db->msgs[i].msg_len;
+}
+
+/**
+ * Takes a pack with @p header and audio data at @p data, of @p size bytes
+ * together, into the batch if it belongs to the played session. A pack of
+ * a newer session resets the pack buffer to it, dropping the packs of the
+ * older one taken so far.
+ * @param i - index of the datagram the pack came in
+ * @param in_slot - whether @p data is in the slot reserved for the
+ * @p i-th datagram
+ */
+inline static void db_take_pack(data_batch *db, receiver_data *rd,
+                                const byte *header, const byte *data,
+                                uint64_t size, uint64_t i, bool in_slot) {
+    uint64_t session_id;
+    uint64_t first_byte_num;
+    uint64_t psize;
+    byte *buf;
+
+    if (size <= 16)
+        return;
+    psize = size - 16;
+
+    memcpy(&session_id, header, 8);
+    memcpy(&first_byte_num, header + 8, 8);
+    session_id = be64toh(session_id);
+    first_byte_num = be64toh(first_byte_num);
+
+    if (session_id > rd->last_session_id) {
+        pb_reset(rd->pb, psize, first_byte_num);
+        atomic_store(&rd->played_session_id, session_id);
+        atomic_store(&rd->played_psize, psize);
+        db->n_packs = 0;
+        db->slots_valid = false;
+    }
+
+    if (session_id < rd->last_session_id)
+        return;
+
+    rd->last_session_id = session_id;
+
+    if (psize != atomic_load(&rd->played_psize) ||
+        db->n_packs == RECV_BATCH_SIZE * GRO_MAX_SEGS)
+        return;
+
+    if (in_slot && !(db->slots_valid && psize == db->slots_psize &&
+                     first_byte_num ==
+                     db->slots_first_byte_num + i * db->slots_psize)) {
+        // A reordered or lost pack put it in a slot reserved for another
+        // one, which may get inserted over it before its turn comes.
+        buf = db->bufs + i * UDP_IPV4_DATASIZE;
+        memcpy(buf, data, min(psize, db->slots_psize));
+        data = buf;
+    }
+
+    db->packs[db->n_packs].first_byte_num = first_byte_num;
+    db->packs[db->n_packs].data = data;
+    db->n_packs++;
+}
+
+/**
+ * Takes the packs of the played session from @p n_dgrams datagrams
+ * received with db_recv(), splitting the ones coalesced by UDP GRO.
+ */
+inline static void db_take_packs(data_batch *db, receiver_data *rd,
+                                 uint64_t n_dgrams) {
+    const byte *datagram;
+    uint64_t size;
+    uint64_t segment_size;
+
+    db->n_packs = 0;
+
+    for (uint64_t i = 0; i < n_dgrams; i++) {
+        size = db->msgs[i].msg_len;
+
+        if (!db->cmsgs) {
+            db_take_pack(db, rd, db->headers + i * 16,
+                         db->iovs[3 * i + 1].iov_base, size, i,
+                         i < db->n_slots);
+            continue;
+        }
+
+        datagram = db->iovs[3 * i].iov_base;
+        segment_size = db_segment_size(db, i);
+
+        for (uint64_t off = 0; off < size; off += segment_size)
+            db_take_pack(db, rd, datagram + off, datagram + off + 16,
+                         min(segment_size, size - off), i, false);
+    }
+}
+
+/**
+ * A report of missing packs split into datagrams that fit in the path MTU,
+ * so that losing a fragment does not lose a whole report, sent to a single
+ * address with one sendmmsg() call.
+ */
+struct rexmit_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *bufs;             /**< @p capacity buffers of @p dgram_size bytes */
 
-    memset(buffer, 0, rd->bsize);
+    struct sockaddr_in dest_address;
 
-    CHECK_ERRNO(pthread_mutex_lock(&rd->mutex));
-    read_length = recvfrom(socket_fd, buffer, rd->bsize, flags, (struct sockaddr
-    *) &rd->client_address, &rd->client_address_len);
-    CHECK_ERRNO(pthread_mutex_unlock(&rd->mutex));
+    uint64_t capacity;
+    uint64_t count;                 /**< number of datagrams written */
+    uint64_t dgram_size;    /**< maximum UDP data size within the path MTU */
+};
 
-    if (read_length < 0)
-        return 0;
+typedef struct rexmit_batch rexmit_batch;
 
-    st_bump_current_station(rd->st);
+inline static rexmit_batch *rb_init(uint64_t capacity, uint64_t mtu) {
+    rexmit_batch *rb = malloc(sizeof(rexmit_batch));
+    if (!rb)
+        fatal("malloc");
 
-    *psize = read_length - 16;
+    rb->capacity = capacity;
+    rb->count = 0;
+    rb->dgram_size = mtu - UDP_IPV4_HEADERS_SIZE;
 
-    memcpy(&(*pack)->session_id, buffer, 8);
-    memcpy(&(*pack)->first_byte_num, buffer + 8, 8);
-    (*pack)->audio_data = buffer + 16;
+    rb->msgs = calloc(capacity, sizeof(struct mmsghdr));
+    rb->iovs = calloc(capacity, sizeof(struct iovec));
+    rb->bufs = malloc(capacity * rb->dgram_size);
+    if (!rb->msgs || !rb->iovs || !rb->bufs)
+        fatal("calloc");
 
-    rd->curr_session_id = be64toh((*pack)->session_id);
+    for (uint64_t i = 0; i < capacity; i++) {
+        rb->iovs[i].iov_base = rb->bufs + i * rb->dgram_size;
+        rb->msgs[i].msg_hdr.msg_iov = &rb->iovs[i];
+        rb->msgs[i].msg_hdr.msg_iovlen = 1;
+        rb->msgs[i].msg_hdr.msg_name = &rb->dest_address;
+        rb->msgs[i].msg_hdr.msg_namelen = sizeof(rb->dest_address);
+    }
 
-    if (rd->curr_session_id > rd->last_session_id)
-        pb_reset(rd->pb, *psize, be64toh((*pack)->first_byte_num));
+    return rb;
+}
 
-    if (rd->curr_session_id < rd->last_session_id)
-        return 0;
+/**
+ * Writes REXMIT or REXMIT_BIN datagrams requesting @p packs until the batch
+ * is full.
+ * @param binary - whether the station takes REXMIT_BIN
+ * @param session_id - session of @p packs, for REXMIT_BIN
+ * @param psize - PSIZE of the session, for REXMIT_BIN
+ * @param packs - increasing first_byte_nums of packs requested
+ * @param n_packs - number of elements in @p packs
+ * @returns number of packs written
+ */
+inline static uint64_t rb_add(rexmit_batch *rb, bool binary,
+                              uint64_t session_id, uint64_t psize,
+                              uint64_t *packs, uint64_t n_packs) {
+    uint64_t n_added = 0;
+    uint64_t n_written;
+    char *buf;
 
-    rd->last_session_id = rd->curr_session_id;
+    while (n_added < n_packs && rb->count < rb->capacity) {
+        buf = rb->iovs[rb->count].iov_base;
+        if (binary)
+            rb->iovs[rb->count].iov_len = write_rexmit_bin(
+                    buf, rb->dgram_size, session_id, psize, packs + n_added,
+                    n_packs - n_added, &n_written);
+        else
+            rb->iovs[rb->count].iov_len = write_rexmit(
+                    buf, rb->dgram_size, packs + n_added, n_packs - n_added,
+                    &n_written);
+        if (n_written == 0)
+            break;
+        n_added += n_written;
+        rb->count++;
+    }
 
-    return read_length;
+    return n_added;
 }
 
+/**
+ * Sends all datagrams written to the batch to @p dest_address through
+ * @p socket_fd and empties the batch.
+ */
+inline static void rb_flush(rexmit_batch *rb, int socket_fd,
+                            const struct sockaddr_in *dest_address) {
+    uint64_t sent = 0;
+    int res;
+
+    rb->dest_address = *dest_address;
+
+    while (sent < rb->count) {
+        errno = 0;
+        res = sendmmsg(socket_fd, rb->msgs + sent, rb->count - sent, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        ENSURE(res > 0);
+
+        for (int i = 0; i < res; i++)
+            ENSURE(rb->msgs[sent + i].msg_len ==
+                   rb->iovs[sent + i].iov_len);
+        sent += res;
+    }
+
+    rb->count = 0;
+}
 
 #endif //_RECEIVER_UTILS_
@@ -1,178 +1,724 @@
-#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rexmit_queue.h"
 
-typedef struct tree_node tree_node;
+#define NO_HAZARD UINT64_MAX
 
-struct tree_node {
-    tree_node *left;
-    uint64_t num;
-    tree_node *right;
+#define RQ_FILE_MAGIC "SIKRQ01"
+// Slots follow the header in the file, so it takes a whole page to keep
+// them page-aligned.
+#define RQ_FILE_HEADER_SIZE 4096
+
+/** Header of a file backing a queue, describing the packs in its slots. */
+struct rq_file_header {
+    char magic[8];
+    uint64_t psize;
+    uint64_t n_slots;
+    uint64_t window;
+    uint64_t session_id;
+    _Atomic uint64_t tail_seq;
+    _Atomic uint64_t head_seq;
 };
 
-tree_node *init_node(uint64_t num) {
-    tree_node *node = malloc(sizeof(tree_node));
-    node->num = num;
-    node->left = node->right = NULL;
-    return node;
-}
-
-tree_node *insert(tree_node *root, uint64_t num) {
-    if (!root)
-        return init_node(num);
-    else if (root->num < num)
-        root->left = insert(root->left, num);
-    else if (root->num > num)
-        root->right = insert(root->right, num);
-
-    return root;
-}
-
-uint64_t tree_to_arr(tree_node *root, uint64_t **arr, uint64_t *arr_size,
-                     uint64_t count) {
-    if (root) {
-        count = tree_to_arr(root->left, arr, arr_size, count);
-        if (*arr_size == count) {
-            if (*arr_size == 0) *arr_size = 1;
-            else *arr_size *= 2;
-            *arr = realloc(*arr, *arr_size * sizeof(uint64_t));
-            if (!(*arr))
-                fatal("realloc");
-        }
-        (*arr)[count++] = root->num;
-        count = tree_to_arr(root->right, arr, arr_size, count);
-    }
-    return count;
+struct rexmit_queue {
+    byte *queue;                    /**< @p n_slots slots of PSIZE bytes */
+    uint64_t n_slots;
+    _Atomic uint64_t window; /**< max number of packs kept for retransmission */
+    uint64_t psize;
+
+    // Bounds of the window, which is resized between them once per pass
+    // over it (at @p epoch_end_seq) to cover the oldest packs requested.
+    // The same if the window is fixed.
+    uint64_t min_window;
+    uint64_t max_window;
+    uint64_t epoch_end_seq;
+    _Atomic uint64_t epoch_max_depth; /**< max head_seq - seq requested */
+    _Atomic uint64_t epoch_misses;
+
+    // Requests of packs that were evicted already and the furthest they
+    // were past the tail, in bytes.
+    _Atomic uint64_t n_misses;
+    _Atomic uint64_t max_miss_distance;
+
+    // Whether pages of evicted packs are given back to the system, and
+    // packs up to which they were.
+    bool release_evicted;
+    uint64_t released_seq;
+
+    // Packs are identified by their sequence number, first_byte_num / PSIZE,
+    // and stored in slot (seq % n_slots). Packs are reserved by one thread
+    // and committed by one thread, possibly another one, while any thread
+    // may read them, so the counters are atomic and no lock is taken.
+    _Atomic uint64_t tail_seq;       /**< oldest pack kept in the queue */
+    _Atomic uint64_t head_seq;         /**< first pack not committed yet */
+    _Atomic uint64_t reserve_seq;           /**< next pack to be reserved */
+
+    bool mapped;       /**< whether @p queue is external read-only data */
+
+    // Mapping the ring lives in and its size; NULL if it is allocated with
+    // malloc() or the data is external.
+    byte *map;
+    uint64_t map_size;
+
+    // Header of the file the ring lives in, kept up to date with the
+    // committed packs; NULL if the ring is in memory.
+    struct rq_file_header *header;
+
+    // Seqlock of each slot: 2 * seq once pack seq is committed to it,
+    // 2 * seq + 1 from its reservation until then. Unused if mapped.
+    _Atomic uint64_t *versions;
+
+    // Oldest pack the read-side guard holder may be sending from its slot,
+    // NO_HAZARD if the guard is not held. Slots of packs it may be sending
+    // are not reused until the guard is released.
+    _Atomic uint64_t hazard_seq;
+
+    // Bit (seq % n_slots) is set if pack seq was requested. Only packs in
+    // the queue may be requested and the queue never holds more than
+    // n_slots packs, so every set bit stands for a single pack.
+    _Atomic uint64_t *requested;
+
+    int request_fd;    /**< eventfd signalled when requests are added */
+
+    // Of the pack in each slot: NACKs that asked for it since it was last
+    // retransmitted and the time of that retransmission (0 if never).
+    _Atomic uint32_t *nack_counts;
+    _Atomic uint64_t *rexmit_times;
+
+    // RQ_MAX_REQUESTERS IPv4 addresses of receivers that asked for the
+    // pack in each slot and their number, if tracked; NULL otherwise. A
+    // number above RQ_MAX_REQUESTERS means too many or unknown ones.
+    _Atomic uint32_t *requesters;
+    _Atomic uint32_t *n_requesters;
+};
+
+typedef struct rexmit_queue rexmit_queue;
+
+#define WORD_BITS 64
+
+// Least amount of memory of evicted packs given back at once.
+#define RELEASE_CHUNK (256 * 1024)
+
+static void _init_common(rexmit_queue *rq) {
+    rq->min_window = rq->max_window = rq->window;
+    rq->epoch_end_seq = 0;
+    atomic_init(&rq->epoch_max_depth, 0);
+    atomic_init(&rq->epoch_misses, 0);
+    atomic_init(&rq->n_misses, 0);
+    atomic_init(&rq->max_miss_distance, 0);
+    rq->release_evicted = false;
+    rq->released_seq = 0;
+
+    atomic_init(&rq->tail_seq, 0);
+    atomic_init(&rq->head_seq, 0);
+    atomic_init(&rq->reserve_seq, 0);
+    atomic_init(&rq->hazard_seq, NO_HAZARD);
+
+    rq->requested = calloc((rq->n_slots + WORD_BITS - 1) / WORD_BITS,
+                           sizeof(uint64_t));
+    if (!rq->requested)
+        fatal("malloc");
+
+    rq->request_fd = eventfd(0, EFD_NONBLOCK);
+    ENSURE(rq->request_fd >= 0);
+
+    rq->nack_counts = calloc(rq->n_slots, sizeof(uint32_t));
+    rq->rexmit_times = calloc(rq->n_slots, sizeof(uint64_t));
+    if (!rq->nack_counts || !rq->rexmit_times)
+        fatal("malloc");
+
+    rq->requesters = NULL;
+    rq->n_requesters = NULL;
 }
 
-void free_tree(tree_node *root) {
-    if (root) {
-        free_tree(root->left);
-        free_tree(root->right);
-        free(root);
-    }
+static void _init_versions(rexmit_queue *rq) {
+    rq->versions = malloc(rq->n_slots * sizeof(uint64_t));
+    if (!rq->versions)
+        fatal("malloc");
+    // No pack has an odd version, so nothing matches a slot never written.
+    for (uint64_t i = 0; i < rq->n_slots; i++)
+        atomic_init(&rq->versions[i], 1);
 }
 
-struct rexmit_queue {
-    byte *queue;
-    byte *queue_end;
+void rq_track_requesters(rexmit_queue *rq) {
+    rq->requesters = calloc(rq->n_slots * RQ_MAX_REQUESTERS,
+                            sizeof(uint32_t));
+    rq->n_requesters = calloc(rq->n_slots, sizeof(uint32_t));
+    if (!rq->requesters || !rq->n_requesters)
+        fatal("malloc");
+}
 
-    byte *tail;
-    byte *head;
+/**
+ * Adds a receiver with @p ip to requesters of the pack in @p slot, unless
+ * it is there already. The check races with other additions, which at
+ * worst adds a duplicate.
+ */
+static void _add_requester(rexmit_queue *rq, uint64_t slot, uint32_t ip) {
+    _Atomic uint32_t *requesters = rq->requesters + slot * RQ_MAX_REQUESTERS;
+    uint32_t n = atomic_load(&rq->n_requesters[slot]);
+
+    for (uint32_t i = 0; i < min(n, RQ_MAX_REQUESTERS); i++)
+        if (atomic_load(&requesters[i]) == ip)
+            return;
+
+    n = atomic_fetch_add(&rq->n_requesters[slot], 1);
+    if (n < RQ_MAX_REQUESTERS)
+        atomic_store(&requesters[n], ip);
+}
 
-    uint64_t head_byte_num; // byte_num of last inserted pack
-    uint64_t tail_byte_num;
+/** Raises @p var to @p value unless it is greater already. */
+static void _atomic_max(_Atomic uint64_t *var, uint64_t value) {
+    uint64_t curr = atomic_load(var);
+    while (curr < value && !atomic_compare_exchange_weak(var, &curr, value))
+        ;
+}
 
-    uint64_t count;
-    uint64_t fsize;
-    uint64_t psize;
+rexmit_queue *rq_init(uint64_t psize, uint64_t fsize, uint64_t staging) {
+    rexmit_queue *rq = malloc(sizeof(rexmit_queue));
+    if (!rq)
+        fatal("malloc");
 
-    tree_node *pack_tree;
+    rq->psize = psize;
+    rq->window = fsize / psize;
+    rq->n_slots = rq->window + staging;
 
-    pthread_mutex_t mutex;
-};
+    rq->queue = malloc(rq->n_slots * psize);
+    if (!rq->queue)
+        fatal("malloc");
+    _init_versions(rq);
 
-typedef struct rexmit_queue rexmit_queue;
+    rq->mapped = false;
+    rq->map = NULL;
+    rq->header = NULL;
+    _init_common(rq);
 
-rexmit_queue *rq_init(uint64_t psize, uint64_t fsize) {
+    return rq;
+}
+
+rexmit_queue *rq_init_adaptive(uint64_t psize, uint64_t fsize,
+                               uint64_t max_fsize, uint64_t staging) {
     rexmit_queue *rq = malloc(sizeof(rexmit_queue));
     if (!rq)
         fatal("malloc");
 
-    rq->queue = malloc(fsize);
-    rq->queue_end = rq->queue + fsize;
+    rq->psize = psize;
+    rq->window = fsize / psize;
+    rq->n_slots = max_fsize / psize + staging;
+
+    // Only pages of slots written to are backed by memory, so the ring
+    // takes as much of it as the window needs.
+    rq->queue = mmap(NULL, rq->n_slots * psize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (rq->queue == MAP_FAILED)
+        fatal("mmap");
+    _init_versions(rq);
+
+    rq->mapped = false;
+    rq->map = rq->queue;
+    rq->map_size = rq->n_slots * psize;
+    rq->header = NULL;
+    _init_common(rq);
+    rq->max_window = max_fsize / psize;
+    rq->epoch_end_seq = rq->window;
+    rq->release_evicted = true;
+
+    return rq;
+}
+
+/**
+ * Checks whether @p header describes packs that a queue of @p rq's shape can
+ * take over.
+ */
+static bool _is_resumable(rexmit_queue *rq, struct rq_file_header *header) {
+    return memcmp(header->magic, RQ_FILE_MAGIC, sizeof(header->magic)) == 0
+           && header->psize == rq->psize && header->n_slots == rq->n_slots
+           && header->window == rq->window
+           && header->tail_seq <= header->head_seq
+           && header->head_seq - header->tail_seq <= rq->window;
+}
+
+rexmit_queue *rq_init_file(uint64_t psize, uint64_t fsize, uint64_t staging,
+                           const char *path, uint64_t *session_id) {
+    rexmit_queue *rq = malloc(sizeof(rexmit_queue));
+    if (!rq)
+        fatal("malloc");
+
+    rq->psize = psize;
+    rq->window = fsize / psize;
+    rq->n_slots = rq->window + staging;
+    rq->mapped = false;
+
+    uint64_t size = RQ_FILE_HEADER_SIZE + rq->n_slots * psize;
+    struct stat st;
+    byte *map;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        fatal("Cannot open %s: %s", path, strerror(errno));
+    CHECK_ERRNO(fstat(fd, &st));
+    // The file is sparse, so only pages of packs sent take up disk space.
+    if ((uint64_t) st.st_size != size)
+        CHECK_ERRNO(ftruncate(fd, size));
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        fatal("Cannot map %s: %s", path, strerror(errno));
+    CHECK_ERRNO(close(fd));
+
+    rq->map = map;
+    rq->map_size = size;
+    rq->header = (struct rq_file_header *) map;
+    rq->queue = map + RQ_FILE_HEADER_SIZE;
+    _init_versions(rq);
+    _init_common(rq);
+
+    if (!_is_resumable(rq, rq->header)) {
+        memset(rq->header, 0, sizeof(*rq->header));
+        memcpy(rq->header->magic, RQ_FILE_MAGIC, sizeof(rq->header->magic));
+        rq->header->psize = psize;
+        rq->header->n_slots = rq->n_slots;
+        rq->header->window = rq->window;
+        rq->header->session_id = *session_id;
+        return rq;
+    }
+
+    // Packs reserved, but not committed before the restart are lost; the
+    // stream goes on from the first of them.
+    *session_id = rq->header->session_id;
+    for (uint64_t seq = rq->header->tail_seq; seq < rq->header->head_seq; seq++)
+        atomic_store(&rq->versions[seq % rq->n_slots], 2 * seq);
+    atomic_store(&rq->tail_seq, rq->header->tail_seq);
+    atomic_store(&rq->head_seq, rq->header->head_seq);
+    atomic_store(&rq->reserve_seq, rq->header->head_seq);
+
+    return rq;
+}
 
-    rq->head = rq->tail = rq->queue;
-    rq->head_byte_num = rq->tail_byte_num = 0;
+rexmit_queue *rq_init_mapped(uint64_t psize, byte *data, uint64_t n_packs) {
+    rexmit_queue *rq = malloc(sizeof(rexmit_queue));
+    if (!rq)
+        fatal("malloc");
 
-    rq->count = 0;
     rq->psize = psize;
-    rq->fsize = fsize;
+    rq->queue = data;
+    rq->n_slots = n_packs;
+    rq->window = n_packs;
+    rq->versions = NULL;
 
-    rq->pack_tree = NULL;
+    rq->mapped = true;
+    rq->map = NULL;
+    rq->header = NULL;
+    _init_common(rq);
 
-    CHECK_ERRNO(pthread_mutex_init(&rq->mutex, NULL));
     return rq;
 }
 
-void rq_add_pack(rexmit_queue *rq, struct audio_pack *pack) {
-    if (!rq || !pack) fatal("null argument");
-    CHECK_ERRNO(pthread_mutex_lock(&rq->mutex));
+void rq_free(rexmit_queue *rq) {
+    if (!rq) fatal("null argument");
+
+    CHECK_ERRNO(close(rq->request_fd));
+    if (rq->map)
+        CHECK_ERRNO(munmap(rq->map, rq->map_size));
+    else if (!rq->mapped)
+        free(rq->queue);
+
+    free(rq->versions);
+    free(rq->requested);
+    free(rq->nack_counts);
+    free(rq->rexmit_times);
+    free(rq->requesters);
+    free(rq->n_requesters);
+    free(rq);
+}
+
+inline static byte *_slot(rexmit_queue *rq, uint64_t seq) {
+    return rq->queue + (seq % rq->n_slots) * rq->psize;
+}
 
-    if (rq->head == rq->tail && rq->count > 0) {
-        // delete tail elem
-        rq->tail_byte_num += rq->psize;
-        rq->count--;
-        rq->tail += rq->psize;
-        if (rq->tail + rq->psize >= rq->queue_end)
-            rq->tail = rq->queue;
+byte *rq_reserve_slot(rexmit_queue *rq, uint64_t *first_byte_num) {
+    if (!rq || !first_byte_num) fatal("null argument");
+
+    uint64_t seq = atomic_load(&rq->reserve_seq);
+
+    // Mapped data is never overwritten, so it can be reused right away.
+    if (!rq->mapped) {
+        // The slot last held pack (seq - n_slots), which must have been
+        // evicted from the retransmission window already.
+        ENSURE(seq - atomic_load(&rq->tail_seq) < rq->n_slots);
+
+        atomic_store(&rq->reserve_seq, seq + 1);
+
+        // The guard holder publishes its hazard before checking that packs
+        // are still in the queue, so either it sees the eviction or this
+        // sees its hazard. It holds the guard for a single send.
+        if (seq >= rq->n_slots)
+            while (seq - rq->n_slots >= atomic_load(&rq->hazard_seq))
+                sched_yield();
+
+        atomic_store_explicit(&rq->versions[seq % rq->n_slots], 2 * seq + 1,
+                              memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    } else
+        atomic_store(&rq->reserve_seq, seq + 1);
+
+    atomic_store(&rq->nack_counts[seq % rq->n_slots], 0);
+    atomic_store(&rq->rexmit_times[seq % rq->n_slots], 0);
+    if (rq->n_requesters)
+        atomic_store(&rq->n_requesters[seq % rq->n_slots], 0);
+
+    *first_byte_num = seq * rq->psize;
+    return _slot(rq, seq);
+}
+
+/**
+ * Resizes the window at the end of its pass over the stream: grows it to
+ * cover the oldest pack requested if any request came too late, shrinks it
+ * gradually if all of them were for packs in its newer half.
+ */
+static void _resize_window(rexmit_queue *rq, uint64_t head) {
+    uint64_t window = atomic_load(&rq->window);
+    uint64_t depth = atomic_exchange(&rq->epoch_max_depth, 0);
+    uint64_t target = window;
+
+    if (atomic_exchange(&rq->epoch_misses, 0) > 0)
+        target = max(window, depth + depth / 4);
+    else if (2 * depth < window)
+        target = max(window - window / 4, 2 * depth);
+
+    target = min(max(target, rq->min_window), rq->max_window);
+    atomic_store(&rq->window, target);
+    rq->epoch_end_seq = head + target;
+}
+
+/**
+ * Gives back the memory of pages holding evicted packs only, a chunk at a
+ * time. Slots of packs older than the widest window may be reserved for
+ * new packs already, and slots of packs the guard holder may be sending
+ * are in use, so they are kept.
+ */
+static void _release_evicted(rexmit_queue *rq, uint64_t head, uint64_t tail) {
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t ring_end = rq->n_slots * rq->psize;
+    uint64_t from = max(rq->released_seq, head - min(head, rq->max_window));
+    uint64_t to = min(tail, atomic_load(&rq->hazard_seq));
+
+    if (to <= from)
+        return;
+    // Wrapped ranges are released up to the end of the ring first.
+    to = min(to, from + rq->n_slots - from % rq->n_slots);
+
+    uint64_t start = from % rq->n_slots * rq->psize;
+    uint64_t end = start + (to - from) * rq->psize;
+    uint64_t page_start = (start + page - 1) / page * page;
+    // The mapping is padded to whole pages past the last slot.
+    uint64_t page_end = end == ring_end ? (end + page - 1) / page * page
+                                        : end / page * page;
+
+    if (page_end < page_start + RELEASE_CHUNK && end != ring_end)
+        return;
+    if (page_end > page_start)
+        CHECK_ERRNO(madvise(rq->queue + page_start, page_end - page_start,
+                            MADV_DONTNEED));
+
+    // Slots sharing the last page with unreleased ones go next time.
+    rq->released_seq = end == ring_end ? to
+                                       : from + (page_end - start) / rq->psize;
+}
+
+void rq_commit_packs(rexmit_queue *rq, uint64_t n_packs) {
+    if (!rq) fatal("null argument");
+
+    uint64_t head = atomic_load(&rq->head_seq);
+    uint64_t tail = atomic_load(&rq->tail_seq);
+    uint64_t slot;
+
+    ENSURE(head + n_packs <= atomic_load(&rq->reserve_seq));
+
+    if (!rq->mapped)
+        for (uint64_t seq = head; seq < head + n_packs; seq++)
+            atomic_store_explicit(&rq->versions[seq % rq->n_slots], 2 * seq,
+                                  memory_order_release);
+
+    head += n_packs;
+
+    if (rq->min_window < rq->max_window && head >= rq->epoch_end_seq)
+        _resize_window(rq, head);
+
+    // Requests of evicted packs are dropped, so that their slots' bits are
+    // clear for the packs reusing them.
+    for (; head - tail > rq->window; tail++) {
+        slot = tail % rq->n_slots;
+        atomic_fetch_and(&rq->requested[slot / WORD_BITS],
+                         ~(1ULL << (slot % WORD_BITS)));
+    }
+
+    atomic_store(&rq->tail_seq, tail);
+    atomic_store(&rq->head_seq, head);
+
+    // The tail goes first, so that a crash in between leaves the header
+    // describing fewer packs rather than ones already overwritten: the
+    // release keeps the stores in order. This covers crashes of the process
+    // only, the file is not msync()ed, so a power loss may leave any state.
+    if (rq->header) {
+        atomic_store_explicit(&rq->header->tail_seq, tail,
+                              memory_order_relaxed);
+        atomic_store_explicit(&rq->header->head_seq, head,
+                              memory_order_release);
     }
 
-    memcpy(rq->head, pack->audio_data, rq->psize);
+    // Only after the eviction is published, so that readers see it or the
+    // release sees their guard.
+    if (rq->release_evicted)
+        _release_evicted(rq, head, tail);
+}
+
+uint64_t rq_fsize(rexmit_queue *rq) {
+    return atomic_load(&rq->window) * rq->psize;
+}
 
-    rq->head_byte_num = be64toh(pack->first_byte_num);
-    rq->count++;
-    rq->head += rq->psize;
+void rq_get_misses(rexmit_queue *rq, rexmit_misses *misses) {
+    misses->n_misses = atomic_load(&rq->n_misses);
+    misses->max_distance = atomic_load(&rq->max_miss_distance);
+}
 
-    if (rq->head + rq->psize >= rq->queue_end)
-        rq->head = rq->queue;
+uint64_t rq_n_slots(rexmit_queue *rq) {
+    return rq->n_slots;
+}
 
-    CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
+static bool _is_in_queue(rexmit_queue *rq, uint64_t first_byte_num) {
+    uint64_t seq = first_byte_num / rq->psize;
+    return first_byte_num % rq->psize == 0 &&
+           seq >= atomic_load(&rq->tail_seq) &&
+           seq < atomic_load(&rq->head_seq);
 }
 
-static byte *_find_pack(rexmit_queue *rq, uint64_t first_byte_num) {
-    uint64_t rel_pos = rq->head_byte_num - first_byte_num;
-    byte *ptr = (rq->head - rq->psize) - rel_pos;
+/**
+ * Records how old the pack requested with @p first_byte_num is, for the
+ * window to be resized to what receivers need.
+ * @returns whether the pack is in the queue
+ */
+static bool _check_request(rexmit_queue *rq, uint64_t first_byte_num) {
+    uint64_t seq = first_byte_num / rq->psize;
+    uint64_t tail = atomic_load(&rq->tail_seq);
+    uint64_t head = atomic_load(&rq->head_seq);
+
+    if (first_byte_num % rq->psize != 0 || seq >= head)
+        return false;
 
-    if (ptr < rq->queue)
-        ptr += rq->fsize;
+    if (rq->min_window < rq->max_window)
+        _atomic_max(&rq->epoch_max_depth, head - seq);
 
-    return ptr;
+    if (seq >= tail)
+        return true;
+
+    atomic_fetch_add(&rq->n_misses, 1);
+    _atomic_max(&rq->max_miss_distance, (tail - seq) * rq->psize);
+    atomic_fetch_add(&rq->epoch_misses, 1);
+    return false;
 }
 
-static void _bind_addr_to_pack(rexmit_queue *rq, uint64_t first_byte_num) {
-    if (first_byte_num < rq->tail_byte_num ||
-        first_byte_num > rq->head_byte_num)
-        return; // request invalid, ignore
+/**
+ * Marks @p requested_packs as requested by @p receiver_addr.
+ * @returns true if any of them was not requested yet
+ */
+static bool _add_requests(rexmit_queue *rq, uint64_t *requested_packs,
+                          uint64_t n_packs,
+                          const struct sockaddr_in *receiver_addr) {
+    bool added = false;
+    uint64_t bit;
+
+    for (size_t i = 0; i < n_packs; i++) {
+        if (!_check_request(rq, requested_packs[i]))
+            continue; // request invalid or too late, ignore
+
+        uint64_t slot = requested_packs[i] / rq->psize % rq->n_slots;
+        bit = 1ULL << (slot % WORD_BITS);
+        if (!(atomic_fetch_or(&rq->requested[slot / WORD_BITS], bit) & bit))
+            added = true;
+        atomic_fetch_add(&rq->nack_counts[slot], 1);
+
+        if (!rq->n_requesters)
+            continue;
+        if (receiver_addr)
+            _add_requester(rq, slot, receiver_addr->sin_addr.s_addr);
+        else
+            atomic_store(&rq->n_requesters[slot], RQ_MAX_REQUESTERS + 1);
+    }
 
-    rq->pack_tree = insert(rq->pack_tree, first_byte_num);
+    return added;
 }
 
 void
-rq_add_requests(rexmit_queue *rq, uint64_t *requested_packs, uint64_t n_packs) {
+rq_add_requests(rexmit_queue *rq, uint64_t *requested_packs, uint64_t n_packs,
+                const struct sockaddr_in *receiver_addr) {
     if (!rq || !requested_packs) fatal("null argument");
-    if (n_packs == 0) return;
-    CHECK_ERRNO(pthread_mutex_lock(&rq->mutex));
-    for (size_t i = 0; i < n_packs; i++)
-        _bind_addr_to_pack(rq, requested_packs[i]);
-    CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
+    if (_add_requests(rq, requested_packs, n_packs, receiver_addr))
+        CHECK_ERRNO(eventfd_write(rq->request_fd, 1));
+}
+
+void rq_add_request_batch(rexmit_queue *rq, const rexmit_request *requests,
+                          uint64_t n_requests) {
+    if (!rq || !requests) fatal("null argument");
+    bool added = false;
+
+    for (uint64_t i = 0; i < n_requests; i++)
+        added |= _add_requests(rq, requests[i].packs, requests[i].n_packs,
+                               requests[i].receiver_addr);
+
+    if (added)
+        CHECK_ERRNO(eventfd_write(rq->request_fd, 1));
+}
+
+void rq_return_requests(rexmit_queue *rq, uint64_t *requested_packs,
+                        uint64_t n_packs) {
+    if (!rq || !requested_packs) fatal("null argument");
+    for (size_t i = 0; i < n_packs; i++) {
+        if (!_is_in_queue(rq, requested_packs[i]))
+            continue;
+
+        uint64_t slot = requested_packs[i] / rq->psize % rq->n_slots;
+        atomic_fetch_or(&rq->requested[slot / WORD_BITS],
+                        1ULL << (slot % WORD_BITS));
+    }
+}
+
+bool rq_mark_rexmit(rexmit_queue *rq, uint64_t first_byte_num, uint64_t now,
+                    uint64_t holdoff, rexmit_info *info) {
+    uint64_t slot = first_byte_num / rq->psize % rq->n_slots;
+    uint64_t last = atomic_load(&rq->rexmit_times[slot]);
+
+    if (last != 0 && now - last < holdoff)
+        return false;
+
+    atomic_store(&rq->rexmit_times[slot], now);
+    info->n_nacks = atomic_exchange(&rq->nack_counts[slot], 0);
+
+    info->n_requesters = RQ_MAX_REQUESTERS + 1;
+    if (!rq->n_requesters)
+        return true;
+
+    info->n_requesters = atomic_exchange(&rq->n_requesters[slot], 0);
+    for (uint32_t i = 0; i < min(info->n_requesters, RQ_MAX_REQUESTERS); i++) {
+        info->requesters[i].s_addr = atomic_exchange(
+                &rq->requesters[slot * RQ_MAX_REQUESTERS + i], 0);
+        // Counted, but not stored yet.
+        if (info->requesters[i].s_addr == 0)
+            info->n_requesters = RQ_MAX_REQUESTERS + 1;
+    }
+
+    return true;
+}
+
+int rq_request_fd(rexmit_queue *rq) {
+    return rq->request_fd;
+}
+
+/**
+ * Moves requests of slots [@p from, @p to) to @p requested_packs, clearing
+ * them in the bitmap. Slot @p from holds pack @p from_seq and the following
+ * slots hold the following packs.
+ * @returns number of first_byte_nums in @p requested_packs afterwards
+ */
+static uint64_t _drain_requests(rexmit_queue *rq, uint64_t from, uint64_t to,
+                                uint64_t from_seq, uint64_t **requested_packs,
+                                uint64_t *arr_size, uint64_t count) {
+    uint64_t bits;
+    uint64_t slot;
+
+    for (uint64_t w = from / WORD_BITS; w * WORD_BITS < to; w++) {
+        bits = atomic_load(&rq->requested[w]);
+        if (w == from / WORD_BITS)
+            bits &= ~0ULL << (from % WORD_BITS);
+        if ((w + 1) * WORD_BITS > to)
+            bits &= (1ULL << (to % WORD_BITS)) - 1;
+        if (!bits)
+            continue;
+        atomic_fetch_and(&rq->requested[w], ~bits);
+
+        while (count + __builtin_popcountll(bits) > *arr_size) {
+            *arr_size = *arr_size == 0 ? WORD_BITS : *arr_size * 2;
+            *requested_packs = realloc(*requested_packs,
+                                       *arr_size * sizeof(uint64_t));
+            if (!(*requested_packs))
+                fatal("realloc");
+        }
+
+        while (bits) {
+            slot = w * WORD_BITS + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            (*requested_packs)[count++] = (from_seq + slot - from) * rq->psize;
+        }
+    }
+
+    return count;
 }
 
 uint64_t rq_get_requests(rexmit_queue *rq, uint64_t **requested_packs,
                          uint64_t *arr_size) {
     if (!rq) fatal("null argument");
-    CHECK_ERRNO(pthread_mutex_lock(&rq->mutex));
-    if (rq->count == 0) {
-        CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
+
+    // Requests racing with evictions at worst ask for a pack that is gone
+    // or was not requested, and both are harmless.
+    uint64_t tail = atomic_load(&rq->tail_seq);
+    if (atomic_load(&rq->head_seq) == tail)
         return 0;
-    }
-    uint64_t count = tree_to_arr(rq->pack_tree, requested_packs, arr_size, 0);
-    free_tree(rq->pack_tree);
-    rq->pack_tree = NULL;
 
-    CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
+    // Oldest packs first: slots from the tail's one to the end of the ring,
+    // then the ones the ring wrapped around to.
+    uint64_t tail_slot = tail % rq->n_slots;
+    uint64_t count = _drain_requests(rq, tail_slot, rq->n_slots, tail,
+                                     requested_packs, arr_size, 0);
+    count = _drain_requests(rq, 0, tail_slot, tail + rq->n_slots - tail_slot,
+                            requested_packs, arr_size, count);
+
     return count;
 }
 
 bool rq_get_pack(rexmit_queue *rq, byte *pack, uint64_t first_byte_num) {
-    CHECK_ERRNO(pthread_mutex_lock(&rq->mutex));
-    if (first_byte_num < rq->tail_byte_num ||
-        first_byte_num > rq->head_byte_num) {
-        CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
+    uint64_t seq = first_byte_num / rq->psize;
+    uint64_t version;
+
+    if (!_is_in_queue(rq, first_byte_num))
         return false;
+
+    if (rq->mapped) {
+        memcpy(pack, _slot(rq, seq), rq->psize);
+        return true;
     }
-    byte *src = _find_pack(rq, first_byte_num);
-    memcpy(pack, src, rq->psize);
-    CHECK_ERRNO(pthread_mutex_unlock(&rq->mutex));
-    return true;
+
+    version = atomic_load_explicit(&rq->versions[seq % rq->n_slots],
+                                   memory_order_acquire);
+    if (version != 2 * seq)
+        return false;
+
+    memcpy(pack, _slot(rq, seq), rq->psize);
+
+    // The slot may have been reserved for another pack during the copy, or
+    // the pack evicted and its memory given back.
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&rq->versions[seq % rq->n_slots],
+                                memory_order_relaxed) == version
+           && seq >= atomic_load(&rq->tail_seq);
+}
+
+void rq_read_lock(rexmit_queue *rq) {
+    ENSURE(atomic_load(&rq->hazard_seq) == NO_HAZARD);
+    atomic_store(&rq->hazard_seq, atomic_load(&rq->tail_seq));
+}
+
+void rq_read_unlock(rexmit_queue *rq) {
+    atomic_store(&rq->hazard_seq, NO_HAZARD);
+}
+
+byte *rq_peek_pack(rexmit_queue *rq, uint64_t first_byte_num) {
+    // Packs still in the queue are at least as new as the hazard.
+    if (!_is_in_queue(rq, first_byte_num))
+        return NULL;
+    return _slot(rq, first_byte_num / rq->psize);
 }
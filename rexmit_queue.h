@@ -6,41 +6,182 @@
 
 /**
  * A structure holding a queue of packs and pending requests of their
- * retransmission. Queue stores at most FSIZE bytes of packs.
+ * retransmission. Queue stores at most FSIZE bytes of packs available for
+ * retransmission. Packs are read straight into their slots: a slot is
+ * reserved first and the pack becomes retransmittable once committed.
+ * Packs are reserved by one thread and committed by one thread; all other
+ * operations are safe from any thread. No operation takes a lock.
  */
 struct rexmit_queue;
 
 typedef struct rexmit_queue rexmit_queue;
 
-struct sockaddr_and_len {
-    struct sockaddr_in addr;
-    socklen_t addr_len;
+/** What is known about the requests of a pack being retransmitted. */
+struct rexmit_info {
+    /** number of NACKs that asked for the pack since its last
+     * retransmission */
+    uint32_t n_nacks;
+
+    /** number of distinct receivers that asked for the pack since its last
+     * retransmission, if tracked; more than RQ_MAX_REQUESTERS if there were
+     * too many or some are unknown */
+    uint32_t n_requesters;
+
+    /** addresses of the receivers if there are at most RQ_MAX_REQUESTERS */
+    struct in_addr requesters[RQ_MAX_REQUESTERS];
+};
+
+typedef struct rexmit_info rexmit_info;
+
+/** Requests of packs that had been evicted from the queue already. */
+struct rexmit_misses {
+    uint64_t n_misses;
+    uint64_t max_distance; /**< furthest past the tail, in bytes */
 };
 
-typedef struct sockaddr_and_len sockaddr_and_len;
+typedef struct rexmit_misses rexmit_misses;
+
+/** Requests for retransmission from a single message of a receiver. */
+struct rexmit_request {
+    uint64_t *packs;      /**< first_byte_nums of packs requested */
+    uint64_t n_packs;
+    const struct sockaddr_in *receiver_addr; /**< NULL if unknown */
+};
+
+typedef struct rexmit_request rexmit_request;
 
 /**
  * Initializes rexmit queue
  * @param psize - value of PSIZE
  * @param fsize - value of FSIZE
+ * @param staging - maximum number of reserved, but not committed packs
+ * @returns pointer to rexmit queue
+ */
+rexmit_queue *rq_init(uint64_t psize, uint64_t fsize, uint64_t staging);
+
+/**
+ * Initializes rexmit queue whose window resizes itself between FSIZE and
+ * @p max_fsize to cover the packs receivers request. It grows when packs
+ * are requested after their eviction and shrinks while requests are for
+ * recent packs only. The ring is reserved for @p max_fsize, but only the
+ * memory of packs in the window is in use.
+ * @param psize - value of PSIZE
+ * @param fsize - initial and minimum FSIZE
+ * @param max_fsize - maximum FSIZE
+ * @param staging - maximum number of reserved, but not committed packs
+ * @returns pointer to rexmit queue
+ */
+rexmit_queue *rq_init_adaptive(uint64_t psize, uint64_t fsize,
+                               uint64_t max_fsize, uint64_t staging);
+
+/**
+ * Initializes rexmit queue whose ring lives in a file at @p path, created
+ * if needed, instead of in memory, so that FSIZE is limited by disk space
+ * rather than RAM. The file's header records the committed packs and their
+ * session. If the file holds packs of a queue of the same PSIZE, FSIZE and
+ * @p staging, e.g. of a sender that was restarted, the queue resumes with
+ * them: packs are reserved from the first one not committed before.
+ * @param psize - value of PSIZE
+ * @param fsize - value of FSIZE
+ * @param staging - maximum number of reserved, but not committed packs
+ * @param path - path to the file
+ * @param session_id - pointer to session_id of the packs queued; set to the
+ * session_id of the packs in the file if the queue resumes with them
  * @returns pointer to rexmit queue
  */
-rexmit_queue *rq_init(uint64_t psize, uint64_t fsize);
+rexmit_queue *rq_init_file(uint64_t psize, uint64_t fsize, uint64_t staging,
+                           const char *path, uint64_t *session_id);
+
+/**
+ * Initializes rexmit queue serving packs straight from @p data, e.g. a
+ * memory-mapped file, instead of a ring of its own. Pack with
+ * first_byte_num n is read from offset (n / PSIZE % n_packs) * PSIZE of
+ * @p data, so the data is repeated once all of it was reserved. The last
+ * @p n_packs committed packs, a whole pass over @p data, stay available
+ * for retransmission.
+ * @param psize - value of PSIZE
+ * @param data - PSIZE * @p n_packs bytes of packs
+ * @param n_packs - number of packs in @p data
+ * @returns pointer to rexmit queue
+ */
+rexmit_queue *rq_init_mapped(uint64_t psize, byte *data, uint64_t n_packs);
+
+/**
+ * Frees the rexmit queue along with its ring, unless the data is external,
+ * and closes its request fd. A file the ring lives in is kept.
+ * @param rq - pointer to rexmit queue
+ */
+void rq_free(rexmit_queue *rq);
+
+/**
+ * Makes the queue track which receivers request each pack, see
+ * rq_mark_rexmit(). Must be called before any requests are added.
+ * @param rq - pointer to rexmit queue
+ */
+void rq_track_requesters(rexmit_queue *rq);
 
 /**
  * Adds @p receiver_addr address' requests for retransmission.
  * @param rq - pointer to rexmit queue
  * @param requested_packs - array of first_byte_nums of requested_packs requested
  * @param n_packs - number of elements in @p requested_packs
- * @param receiver_addr - address of the receiver that issued the requested
+ * @param receiver_addr - address of the receiver that issued the requested;
+ * NULL if unknown
  */
 void
-rq_add_requests(rexmit_queue *rq, uint64_t *requested_packs, uint64_t n_packs);
+rq_add_requests(rexmit_queue *rq, uint64_t *requested_packs, uint64_t n_packs,
+                const struct sockaddr_in *receiver_addr);
+
+/**
+ * Adds requests for retransmission of several receivers at once, waking
+ * the retransmitter at most once for all of them.
+ * @param rq - pointer to rexmit queue
+ * @param requests - array of requests
+ * @param n_requests - number of elements in @p requests
+ */
+void rq_add_request_batch(rexmit_queue *rq, const rexmit_request *requests,
+                          uint64_t n_requests);
+
+/**
+ * Puts back requests taken with rq_get_requests() that could not be served
+ * yet. Unlike rq_add_requests(), it neither counts them as new NACKs nor
+ * signals the request fd.
+ * @param rq - pointer to rexmit queue
+ * @param requested_packs - array of first_byte_nums of packs to put back
+ * @param n_packs - number of elements in @p requested_packs
+ */
+void rq_return_requests(rexmit_queue *rq, uint64_t *requested_packs,
+                        uint64_t n_packs);
+
+/**
+ * Records that the pack with the specified @p first_byte_num is being
+ * retransmitted at @p now, unless it already was less than @p holdoff
+ * nanoseconds earlier. Only the thread retransmitting packs may call it.
+ * @param rq - pointer to rexmit queue
+ * @param first_byte_num - byte_num of a pack in the queue
+ * @param now - current time in nanoseconds
+ * @param holdoff - minimum time between retransmissions of the pack
+ * @param info - pointer to what is known about the pack's requests since
+ * its last retransmission, set if it is retransmitted. Requesters are
+ * unknown unless tracked with rq_track_requesters().
+ * @returns true if the pack should be retransmitted; false if suppressed
+ */
+bool rq_mark_rexmit(rexmit_queue *rq, uint64_t first_byte_num, uint64_t now,
+                    uint64_t holdoff, rexmit_info *info);
+
+/**
+ * Returns a nonblocking eventfd that becomes readable when a pack that was
+ * not requested yet is requested with rq_add_requests(). Readers should
+ * clear it with eventfd_read() before getting the requests.
+ * @param rq - pointer to rexmit queue
+ */
+int rq_request_fd(rexmit_queue *rq);
 
 /**
  * Gets an array with first_byte_nums of packs that were requested for
- * retransmission. Note that is not guaranteed that all the packs are still in
- * the queue and can be recovered with rq_get_pack().
+ * retransmission since the last call, each once and the oldest first. Note
+ * that is not guaranteed that all the packs are still in the queue and can
+ * be recovered with rq_get_pack().
  *
  * @param rq - pointer to rexmit queue
  * @param requested_packs - pointer to array of requested first_byte_nums
@@ -52,6 +193,8 @@ uint64_t rq_get_requests(rexmit_queue *rq, uint64_t **requested_packs, uint64_t
 
 /**
  * Pops a pack data with the specified @p first_byte_num to @p pack_data buffer.
+ * Copies torn by the slot being reserved for a newer pack meanwhile are
+ * detected and reported as not found.
  *
  * @param rq - pointer to rexmit queue
  * @param pack_data - audio_data buffer
@@ -61,12 +204,73 @@ uint64_t rq_get_requests(rexmit_queue *rq, uint64_t **requested_packs, uint64_t
 bool rq_get_pack(rexmit_queue *rq, byte *pack_data, uint64_t first_byte_num);
 
 /**
- * Adds a pack to the queue. If there is not enough space in the queue,
- * removes the oldest pack from the queue. Assumes pack has exactly
- * PSIZE bytes.
+ * Takes the read-side guard of the queue. While it is held, slots of packs
+ * found with rq_peek_pack() are not reused, so the packs can be sent
+ * straight from them. Packs keep being reserved and committed meanwhile,
+ * until a reservation would reuse the slot of a pack that was in the queue
+ * when the guard was taken, so it should be held briefly, e.g. for a single
+ * send. Only one thread may hold the guard at a time.
+ * @param rq - pointer to rexmit queue
+ */
+void rq_read_lock(rexmit_queue *rq);
+
+/**
+ * Releases the guard taken with rq_read_lock().
+ * @param rq - pointer to rexmit queue
+ */
+void rq_read_unlock(rexmit_queue *rq);
+
+/**
+ * Finds audio_data of the pack with the specified @p first_byte_num in its
+ * slot. Must be called with the read-side guard held.
+ *
+ * @param rq - pointer to rexmit queue
+ * @param first_byte_num - byte_num of the pack to find
+ * @returns pointer to PSIZE bytes valid until the guard is released; NULL if
+ * pack not found
+ */
+byte *rq_peek_pack(rexmit_queue *rq, uint64_t first_byte_num);
+
+/**
+ * Reserves a slot for the next pack of the stream. Slots are reserved in the
+ * order of first_byte_nums, starting from 0. The slot stays valid until the
+ * pack is committed with rq_commit_packs() and then for as long as the pack
+ * is kept in the queue. At most @p staging packs may be reserved, but not
+ * committed at a time.
+ * @param rq - pointer to rexmit queue
+ * @param first_byte_num - pointer to first_byte_num of the reserved pack
+ * @returns pointer to PSIZE bytes of the slot; read-only for queues
+ * initialized with rq_init_mapped()
+ */
+byte *rq_reserve_slot(rexmit_queue *rq, uint64_t *first_byte_num);
+
+/**
+ * Makes @p n_packs oldest reserved packs available for retransmission.
+ * If the queue holds more than FSIZE bytes of packs afterwards, the oldest
+ * packs are removed from the queue.
+ * @param rq - pointer to rexmit queue
+ * @param n_packs - number of packs to commit
+ */
+void rq_commit_packs(rexmit_queue *rq, uint64_t n_packs);
+
+/**
+ * Returns the current FSIZE: bytes of packs kept for retransmission.
+ * @param rq - pointer to rexmit queue
+ */
+uint64_t rq_fsize(rexmit_queue *rq);
+
+/**
+ * Gets statistics of requests of packs that were evicted already.
+ * @param rq - pointer to rexmit queue
+ * @param misses - pointer to the statistics
+ */
+void rq_get_misses(rexmit_queue *rq, rexmit_misses *misses);
+
+/**
+ * Returns the number of slots in the queue. A reserved slot is reused by the
+ * pack reserved that many packs later.
  * @param rq - pointer to rexmit queue
- * @param pack - pack to insert
  */
-void rq_add_pack(rexmit_queue *rq, struct audio_pack *pack);
+uint64_t rq_n_slots(rexmit_queue *rq);
 
 #endif //_REXMIT_QUEUE_
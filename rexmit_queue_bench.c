@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "rexmit_queue.h"
+
+#define PSIZE 512
+#define N_PACKS 20000
+#define N_REQUESTS 10000
+#define ROUNDS 100
+#define TREE_ROUNDS 3 // a round takes about a second
+
+// Request tree rexmit_queue used before, for comparison.
+typedef struct tree_node tree_node;
+
+struct tree_node {
+    tree_node *left;
+    uint64_t num;
+    tree_node *right;
+};
+
+tree_node *init_node(uint64_t num) {
+    tree_node *node = malloc(sizeof(tree_node));
+    node->num = num;
+    node->left = node->right = NULL;
+    return node;
+}
+
+tree_node *insert(tree_node *root, uint64_t num) {
+    if (!root)
+        return init_node(num);
+    else if (root->num < num)
+        root->left = insert(root->left, num);
+    else if (root->num > num)
+        root->right = insert(root->right, num);
+
+    return root;
+}
+
+uint64_t tree_to_arr(tree_node *root, uint64_t **arr, uint64_t *arr_size,
+                     uint64_t count) {
+    if (root) {
+        count = tree_to_arr(root->left, arr, arr_size, count);
+        if (*arr_size == count) {
+            if (*arr_size == 0) *arr_size = 1;
+            else *arr_size *= 2;
+            *arr = realloc(*arr, *arr_size * sizeof(uint64_t));
+            if (!(*arr))
+                fatal("realloc");
+        }
+        (*arr)[count++] = root->num;
+        count = tree_to_arr(root->right, arr, arr_size, count);
+    }
+    return count;
+}
+
+void free_tree(tree_node *root) {
+    if (root) {
+        free_tree(root->left);
+        free_tree(root->right);
+        free(root);
+    }
+}
+
+int main() {
+    rexmit_queue *rq = rq_init(PSIZE, N_PACKS * PSIZE, 1);
+    uint64_t first_byte_num;
+
+    for (uint64_t i = 0; i < N_PACKS; i++) {
+        rq_reserve_slot(rq, &first_byte_num);
+        rq_commit_packs(rq, 1);
+    }
+
+    // parse_rexmit() yields ascending numbers, as receivers list them.
+    uint64_t *requests = malloc(N_REQUESTS * sizeof(uint64_t));
+    if (!requests)
+        fatal("malloc");
+    for (uint64_t i = 0; i < N_REQUESTS; i++)
+        requests[i] = (N_PACKS - N_REQUESTS + i) * PSIZE;
+
+    uint64_t *arr = NULL;
+    uint64_t arr_size = 0;
+    uint64_t count = 0;
+
+    uint64_t start = monotonic_nsec();
+    for (int r = 0; r < ROUNDS; r++) {
+        rq_add_requests(rq, requests, N_REQUESTS, NULL);
+        count = rq_get_requests(rq, &arr, &arr_size);
+    }
+    uint64_t elapsed = monotonic_nsec() - start;
+
+    printf("bitmap: %d NACKs of %lu packs, %lu ns/NACK, %.1f ns/pack\n",
+           ROUNDS, count, elapsed / ROUNDS,
+           (double) elapsed / ROUNDS / N_REQUESTS);
+
+    tree_node *tree = NULL;
+
+    start = monotonic_nsec();
+    for (int r = 0; r < TREE_ROUNDS; r++) {
+        for (uint64_t i = 0; i < N_REQUESTS; i++)
+            tree = insert(tree, requests[i]);
+        count = tree_to_arr(tree, &arr, &arr_size, 0);
+        free_tree(tree);
+        tree = NULL;
+    }
+    elapsed = monotonic_nsec() - start;
+
+    printf("tree:   %d NACKs of %lu packs, %lu ns/NACK, %.1f ns/pack\n",
+           TREE_ROUNDS, count, elapsed / TREE_ROUNDS,
+           (double) elapsed / TREE_ROUNDS / N_REQUESTS);
+
+    free(arr);
+    free(requests);
+    rq_free(rq);
+}
@@ -1,64 +1,191 @@
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdint-gcc.h>
-#include "err.h"
-
-typedef struct tree_node tree_node;
-
-struct tree_node {
-    tree_node *left;
-    uint64_t num;
-    tree_node *right;
-};
-
-tree_node *init_node(uint64_t num) {
-    tree_node *node = malloc(sizeof(tree_node));
-    node->num = num;
-    node->left = node->right = NULL;
-    return node;
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "rexmit_queue.h"
+
+#define PSIZE 4
+#define WINDOW 100
+#define STRESS_PSIZE 65536
+#define STRESS_PACKS 1000000
+
+static volatile bool stress_done;
+static volatile uint64_t stress_written;
+
+static void push_packs(rexmit_queue *rq, uint64_t n_packs) {
+    uint64_t first_byte_num;
+    byte *slot;
+
+    for (uint64_t i = 0; i < n_packs; i++) {
+        slot = rq_reserve_slot(rq, &first_byte_num);
+        memset(slot, (int) first_byte_num, PSIZE);
+        rq_commit_packs(rq, 1);
+    }
 }
 
-tree_node *insert(tree_node *root, uint64_t num) {
-    if (!root)
-        return init_node(num);
-    else if (root->num < num)
-        root->left = insert(root->left, num);
-    else if (root->num > num)
-        root->right = insert(root->right, num);
+static void *stress_writer(void *args) {
+    rexmit_queue *rq = args;
+    uint64_t first_byte_num;
+    byte *slot;
+
+    for (uint64_t i = 0; i < STRESS_PACKS; i++) {
+        // Writing the ends only is quick, so reads fall behind and tear.
+        slot = rq_reserve_slot(rq, &first_byte_num);
+        slot[0] = slot[STRESS_PSIZE - 1] = i % 251;
+        rq_commit_packs(rq, 1);
+        stress_written = i;
+    }
+    stress_done = true;
 
-    return root;
+    return 0;
 }
 
-uint64_t tree_to_arr(tree_node *root, uint64_t **arr, uint64_t *arr_size) {
-    uint64_t count = 0;
-    if (root) {
-        count += tree_to_arr(root->left, arr, arr_size);
-        if (*arr_size == count) {
-            if (*arr_size == 0) *arr_size = 1;
-            else *arr_size *= 2;
-            *arr = realloc(*arr, *arr_size * sizeof(uint64_t));
-            if (!(*arr))
-                fatal("realloc");
-        }
-        (*arr)[count++] = root->num;
-        count += tree_to_arr(root->right, arr, arr_size);
+// Reads packs of a tiny queue being overwritten all the time. Every read
+// that succeeds must be a whole, untorn pack.
+static void stress_reads(rexmit_queue *rq) {
+    byte *pack = malloc(STRESS_PSIZE);
+    uint64_t n_read = 0;
+    uint64_t n_torn = 0;
+    pthread_t writer;
+
+    stress_done = false;
+    stress_written = 0;
+    pthread_create(&writer, NULL, stress_writer, rq);
+    // Reads lag behind by 3 to 6 packs, so some are of packs just evicted.
+    for (uint64_t i = 0, seq = 0; !stress_done;
+         i++, seq = stress_written - 3 - i % 4) {
+        if (!rq_get_pack(rq, pack, seq * STRESS_PSIZE))
+            continue;
+        n_read++;
+        if (pack[0] != seq % 251 || pack[STRESS_PSIZE - 1] != seq % 251)
+            n_torn++;
     }
-    return count;
+    pthread_join(writer, NULL);
+
+    assert(n_torn == 0);
+    printf("stress: %lu packs read while overwritten\n", n_read);
+    free(pack);
+    rq_free(rq);
+}
+
+// A queue kept in a file is taken over by the one of a restarted sender.
+static void file_resume() {
+    char path[] = "/tmp/rexmit_queue_testsXXXXXX";
+    int fd = mkstemp(path);
+    uint64_t session_id = 42;
+    uint64_t first_byte_num;
+    byte pack[PSIZE];
+
+    assert(fd >= 0);
+    close(fd);
+
+    rexmit_queue *rq = rq_init_file(PSIZE, WINDOW * PSIZE, 30, path,
+                                    &session_id);
+    assert(session_id == 42);
+    push_packs(rq, 150);
+    // Reserved, but never committed.
+    rq_reserve_slot(rq, &first_byte_num);
+    rq_free(rq);
+
+    session_id = 43;
+    rq = rq_init_file(PSIZE, WINDOW * PSIZE, 30, path, &session_id);
+    assert(session_id == 42);
+    assert(rq_get_pack(rq, pack, 149 * PSIZE));
+    assert(pack[0] == (byte) (149 * PSIZE));
+    assert(rq_get_pack(rq, pack, 50 * PSIZE));
+    assert(!rq_get_pack(rq, pack, 49 * PSIZE));
+    rq_reserve_slot(rq, &first_byte_num);
+    assert(first_byte_num == 150 * PSIZE);
+    rq_free(rq);
+
+    // Packs of another size are not taken over.
+    session_id = 44;
+    rq = rq_init_file(PSIZE, 2 * WINDOW * PSIZE, 30, path, &session_id);
+    assert(session_id == 44);
+    assert(!rq_get_pack(rq, pack, 149 * PSIZE));
+    rq_free(rq);
+
+    unlink(path);
 }
 
+// Requests of evicted packs are counted and make an adaptive queue grow;
+// it shrinks back while nothing old is requested.
+static void adaptive_window() {
+    rexmit_queue *rq = rq_init_adaptive(PSIZE, 16 * PSIZE, 256 * PSIZE, 1);
+    rexmit_misses misses;
+    uint64_t request = 10 * PSIZE;
+
+    push_packs(rq, 100);
+    rq_add_requests(rq, &request, 1, NULL);
+    rq_get_misses(rq, &misses);
+    assert(misses.n_misses == 1);
+    assert(misses.max_distance == 74 * PSIZE);
+
+    // The window is resized at the end of its pass over the stream.
+    push_packs(rq, 16);
+    assert(rq_fsize(rq) == (90 + 90 / 4) * PSIZE);
+
+    push_packs(rq, 2000);
+    assert(rq_fsize(rq) == 16 * PSIZE);
+    rq_free(rq);
+}
 
 int main() {
-    tree_node *t = NULL;
-    for (int i = 0; i < 10; i++)
-        t = insert(t, i);
-    for (int i = 0; i < 10; i++)
-        t = insert(t, i);
+    rexmit_queue *rq = rq_init(PSIZE, WINDOW * PSIZE, 30);
 
     uint64_t *arr = NULL;
     uint64_t arr_size = 0;
-    uint64_t count = tree_to_arr(t, &arr, &arr_size);
+    uint64_t count;
+
+    push_packs(rq, 50);
+
+    // Duplicates, unaligned and not yet sent packs are dropped.
+    uint64_t requests[] = {40, 8, 40, 0, 9, 196, 200, 8};
+    rq_add_requests(rq, requests, 8, NULL);
+
+    count = rq_get_requests(rq, &arr, &arr_size);
+    assert(count == 4);
+    assert(arr[0] == 0 && arr[1] == 8 && arr[2] == 40 && arr[3] == 196);
+
+    count = rq_get_requests(rq, &arr, &arr_size);
+    assert(count == 0);
 
-    for (int i = 0; i < count; i++)
-        printf("%lu\n", arr[i]);
+    // The ring wraps around: packs 20..119 are kept in 130 slots.
+    push_packs(rq, 70);
 
-}
\ No newline at end of file
+    uint64_t wrapped[WINDOW + 1];
+    for (uint64_t i = 0; i <= WINDOW; i++)
+        wrapped[i] = (119 - i) * PSIZE;
+    rq_add_requests(rq, wrapped, WINDOW + 1, NULL);
+
+    count = rq_get_requests(rq, &arr, &arr_size);
+    assert(count == WINDOW);
+    for (uint64_t i = 0; i < count; i++)
+        assert(arr[i] == (20 + i) * PSIZE);
+
+    // Requests of evicted packs do not show up as their slots' new packs.
+    rq_add_requests(rq, wrapped, 10, NULL);
+    push_packs(rq, 130);
+    count = rq_get_requests(rq, &arr, &arr_size);
+    assert(count == 0);
+
+    byte pack[PSIZE];
+    bool found = rq_get_pack(rq, pack, 249 * PSIZE);
+    assert(found && pack[0] == (byte) (249 * PSIZE));
+    found = rq_get_pack(rq, pack, 149 * PSIZE);
+    assert(!found);
+
+    free(arr);
+    rq_free(rq);
+
+    file_resume();
+    adaptive_window();
+    stress_reads(rq_init(STRESS_PSIZE, 4 * STRESS_PSIZE, 1));
+    // Pages of evicted packs are given back while they are read.
+    stress_reads(rq_init_adaptive(STRESS_PSIZE, 4 * STRESS_PSIZE,
+                                  64 * STRESS_PSIZE, 1));
+
+    printf("rexmit_queue_tests: OK\n");
+}
@@ -1,138 +1,848 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "err.h"
 #include "common.h"
 #include "ctrl_protocol.h"
 #include "rexmit_queue.h"
+#include "pacer.h"
+#include "input_ring.h"
 #include "sender_utils.h"
 
+/**
+ * Sends all packs collected in @p sb to the multicast group and makes them
+ * available for retransmission.
+ */
+static void flush_live_batch(sender_data *sd, send_batch *sb) {
+    uint64_t n_packs = sb->count;
+
+    if (n_packs == 0)
+        return;
+
+    if (sd->pacer)
+        pacer_wait(sd->pacer);
+
+    sb_flush(sb, sd->mcast_send_sock_fd, sd->zt);
+    rq_commit_packs(sd->rq, n_packs);
+
+    if (sd->pacer)
+        pacer_consume(sd->pacer, n_packs * sd->psize);
+
+    if (sd->zt)
+        zt_reap(sd->zt, false);
+}
+
+/**
+ * Waits until the kernel no longer uses the slot reserved for pack @p seq
+ * for a previous MSG_ZEROCOPY send. Live packs are the only zerocopy sends
+ * and they are sent in order, so n-th datagram sent is pack n.
+ */
+static void wait_for_slot(sender_data *sd, uint64_t seq) {
+    uint64_t n_slots = rq_n_slots(sd->rq);
+
+    while (seq >= zt_completed_dgrams(sd->zt) + n_slots)
+        zt_reap(sd->zt, true);
+}
+
+/**
+ * Reads packs from the input straight into their rexmit queue slots and
+ * passes them to pack_sender through the input ring. A pack with NULL
+ * audio_data marks the end of input. Packs of a memory-mapped input file
+ * are not read at all: their slots point into the mapping.
+ */
+static void *pack_reader(void *args) {
+    sender_data *sd = args;
+    uint64_t first_byte_num;
+
+    struct audio_pack pack;
+    pack.session_id = htobe64(sd->session_id);
+
+    do {
+        pack.audio_data = rq_reserve_slot(sd->rq, &first_byte_num);
+        pack.first_byte_num = htobe64(first_byte_num);
+
+        if (sd->input_map) {
+            if (!sd->loop && first_byte_num / sd->psize == sd->input_packs)
+                pack.audio_data = NULL;
+        } else if (!read_pack(sd->input_fd, pack.audio_data, sd->psize))
+            pack.audio_data = NULL;
+
+        ir_push(sd->ir, &pack);
+    } while (pack.audio_data);
+
+    return 0;
+}
+
 static void *pack_sender(void *args) {
     sender_data *sd = args;
-    uint64_t pack_num = 0;
+    uint64_t next_seq = 0;
+    uint64_t deadline;
+    bool eof = false;
 
-    byte *read_bytes = (byte *) malloc(sd->psize);
+    send_batch *sb = sb_init(sd->batch_size, sd->psize, &sd->mcast_addr);
+    if (sd->gso)
+        sb_enable_gso(sb, sd->zt != NULL);
 
-    while (!feof(stdin)) {
-        memset(read_bytes, 0, sd->psize);
+    struct audio_pack pack;
 
-        if (sd->psize == read_pack(stdin, sd->psize, read_bytes)) {
-            struct audio_pack pack;
+    while (!eof) {
+        if (sb->count == 0)
+            deadline = NO_DEADLINE;
+        else
+            deadline = sb->first_added_ns + sd->batch_delay_ns;
 
-            pack.session_id = htobe64(sd->session_id);
-            pack.first_byte_num = be64toh(pack_num * sd->psize);
-            pack.audio_data = read_bytes;
+        // Taking a pack off the ring lets the reader reserve a slot up to
+        // this many packs ahead.
+        if (sd->zt)
+            wait_for_slot(sd, next_seq + ir_capacity(sd->ir) + 1);
+
+        if (!ir_pop(sd->ir, &pack, deadline)) {
+            flush_live_batch(sd, sb);
+            continue;
+        }
 
-            send_pack(sd->mcast_send_sock_fd, &sd->mcast_addr, &pack, sd);
-            rq_add_pack(sd->rq, &pack);
+        if (pack.audio_data) {
+            sb_add(sb, &pack);
+            next_seq++;
+        } else
+            eof = true;
 
-            pack_num++;
-        } else break;
+        if (eof || sb_is_full(sb))
+            flush_live_batch(sd, sb);
     }
 
     mark_finished(sd);
 
-    free(read_bytes);
+    sb_free(sb);
 
     return 0;
 }
 
-static void *ctrl_listener(void *args) {
-    sender_data *sd = args;
-    int ctrl_sock_fd = create_timeoutable_socket(sd->ctrl_port);
-
-    char *buffer = malloc(CTRL_BUF_SIZE);
-    uint64_t *packs = malloc(CTRL_BUF_SIZE);
-    uint64_t n_packs;
-
-    struct sockaddr_in receiver_addr;
-    socklen_t address_length = (socklen_t) sizeof(receiver_addr);
+static void print_rexmit_stats(sender_data *sd) {
+    fprintf(stderr, "%s: retransmitted %lu packs (%lu datagrams unicast) "
+                    "for %lu NACKs, suppressed %lu requests, put off "
+                    "requests %lu times\n",
+            sd->sender_name, atomic_load(&sd->rexmit_stats.sent),
+            atomic_load(&sd->rexmit_stats.unicast),
+            atomic_load(&sd->rexmit_stats.nacks),
+            atomic_load(&sd->rexmit_stats.suppressed),
+            atomic_load(&sd->rexmit_stats.deferred));
+
+    rexmit_misses misses;
+    rq_get_misses(sd->rq, &misses);
+    fprintf(stderr, "%s: %lu requests too late (up to %lu bytes past the "
+                    "FIFO), FSIZE %lu\n",
+            sd->sender_name, misses.n_misses, misses.max_distance,
+            rq_fsize(sd->rq));
+}
 
-    int flags = 0;
+static void *stats_reporter(void *args) {
+    sender_data *sd = args;
+    struct pollfd pfd = {.fd = sd->finish_fd, .events = POLLIN};
+    int timeout_ms = min(sd->stats_interval * 1000, (uint64_t) INT_MAX);
+    int res;
+
+    // Waits for the sender to finish between reports, so that shutdown is
+    // not held up for the rest of an interval.
+    while ((res = poll(&pfd, 1, timeout_ms)) <= 0) {
+        if (res < 0) {
+            ENSURE(errno == EINTR);
+            continue;
+        }
+        fprintf(stderr, "input ring: %lu/%lu packs (peak %lu)\n",
+                ir_occupancy(sd->ir), ir_capacity(sd->ir),
+                ir_take_peak_occupancy(sd->ir));
+        print_rexmit_stats(sd);
+    }
 
-    int wrote_size;
-    ssize_t sent_size;
+    return 0;
+}
 
-    while (!is_finished(sd)) {
-        memset(buffer, 0, CTRL_BUF_SIZE);
+/** A thread listening on the control port. */
+struct ctrl_listener_args {
+    sender_data *sd;
+    /** whether it answers LOOKUPs broadcast to all listeners */
+    bool answers_broadcasts;
+};
+
+typedef struct ctrl_listener_args ctrl_listener_args;
+
+/**
+ * Hands all retransmission requests of a batch of control messages to the
+ * rexmit queue at once, then answers its LOOKUPs, so that discovery does
+ * not hold up retransmissions.
+ */
+static void serve_ctrl_batch(sender_data *sd, int ctrl_sock_fd,
+                             ctrl_batch *cb, uint64_t n_msgs,
+                             lookup_limiter *ll, bool answers_broadcasts) {
+    uint64_t n_packs;
+    uint64_t session_id;
+    uint64_t psize;
+    uint64_t now = monotonic_nsec();
+    char *msg;
 
-        recvfrom(ctrl_sock_fd, buffer, CTRL_BUF_SIZE, flags,
-                 (struct sockaddr *) &receiver_addr, &address_length);
+    for (uint64_t i = 0; i < n_msgs; i++) {
+        msg = cb_msg(cb, i);
 
-        switch (what_message(buffer)) {
+        switch (what_message(msg)) {
             case LOOKUP:
-                memset(buffer, 0, CTRL_BUF_SIZE);
-                wrote_size = write_reply(buffer, sd->mcast_addr_str, sd->port,
-                                         sd->sender_name);
-                errno = 0;
-                sent_size = sendto(ctrl_sock_fd, buffer, wrote_size,
-                                   flags, (struct sockaddr *)
-                                           &receiver_addr,
-                                   address_length);
-                ENSURE(sent_size == wrote_size);
+                if ((answers_broadcasts || !cb_is_broadcast(cb, i)) &&
+                    ll_allow(ll, &cb->addrs[i], now))
+                    cb_add_reply(cb, i, sd->reply, sd->reply_size);
                 break;
             case REXMIT:
-                memset(packs, 0, CTRL_BUF_SIZE);
-                parse_rexmit(buffer, packs, &n_packs);
-                rq_add_requests(sd->rq, packs, n_packs);
+                parse_rexmit(msg, cb->msgs[i].msg_len, cb_next_packs(cb),
+                             CTRL_MAX_PACKS, &n_packs);
+                cb_add_request(cb, n_packs, &cb->addrs[i]);
+                break;
+            case REXMIT_BIN:
+                if (parse_rexmit_bin(msg, cb->msgs[i].msg_len, &session_id,
+                                     &psize, cb_next_packs(cb), CTRL_MAX_PACKS,
+                                     &n_packs) == 0 &&
+                    session_id == sd->session_id && psize == sd->psize)
+                    cb_add_request(cb, n_packs, &cb->addrs[i]);
                 break;
         }
     }
 
+    rq_add_request_batch(sd->rq, cb->requests, cb->n_requests);
+    cb_send_replies(cb, ctrl_sock_fd);
+}
+
+// epoll_event data of a control listener's socket and of the finish fd.
+#define EV_LISTENER_CTRL 0
+#define EV_LISTENER_FINISH 1
+
+/**
+ * Serves control messages in batches as they come, until the sender is
+ * finished. With several listeners, each has its own SO_REUSEPORT socket;
+ * LOOKUPs broadcast to all of them are answered by one only.
+ */
+static void *ctrl_listener(void *args) {
+    ctrl_listener_args *la = args;
+    sender_data *sd = la->sd;
+    bool shared = sd->ctrl_listeners > 1;
+    int ctrl_sock_fd = shared ? create_shared_socket(sd->ctrl_port)
+                              : create_socket(sd->ctrl_port);
+    int epoll_fd = epoll_create1(0);
+    ENSURE(epoll_fd >= 0);
+
+    int opt = 1;
+    if (shared)
+        CHECK_ERRNO(setsockopt(ctrl_sock_fd, IPPROTO_IP, IP_PKTINFO, &opt,
+                               sizeof(opt)));
+    ctrl_batch *cb = cb_init(shared, 1);
+    lookup_limiter *ll = ll_init(sd->lookup_interval_ns);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EV_LISTENER_CTRL};
+    CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctrl_sock_fd, &ev));
+    ev.data.u64 = EV_LISTENER_FINISH;
+    CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sd->finish_fd, &ev));
+
+    struct epoll_event events[2];
+    bool finished = false;
+    uint64_t n_msgs;
+    int n_events;
+
+    while (!finished) {
+        n_events = epoll_wait(epoll_fd, events, 2, -1);
+        if (n_events < 0 && errno == EINTR)
+            continue;
+        ENSURE(n_events >= 0);
+
+        for (int e = 0; e < n_events; e++)
+            if (events[e].data.u64 == EV_LISTENER_FINISH)
+                finished = true;
+        if (finished)
+            break;
+
+        // One batch per wakeup; epoll reports the rest right away.
+        n_msgs = cb_recv(cb, ctrl_sock_fd);
+        serve_ctrl_batch(sd, ctrl_sock_fd, cb, n_msgs, ll,
+                         la->answers_broadcasts);
+    }
+
+    CHECK_ERRNO(close(epoll_fd));
     CHECK_ERRNO(close(ctrl_sock_fd));
-    free(buffer);
-    free(packs);
+    cb_free(cb);
+    ll_free(ll);
 
     return 0;
 }
 
+/** Retransmission of a sender's packs, coalescing requests for RTIME. */
+struct rexmitter {
+    send_batch *sb;          /**< packs sent to the repair group */
+    send_batch *unicast_sb;  /**< packs sent to the receivers that lost them */
+    uint64_t *requested_nums;
+    uint64_t arr_size;
+
+    uint64_t deadline_ns; /**< when coalesced requests are due, if any */
+    uint64_t resume_ns;  /**< when there is budget for put off requests */
+};
+
+typedef struct rexmitter rexmitter;
+
+static void rx_init(rexmitter *rx, sender_data *sd) {
+    rx->sb = sb_init(sd->batch_size, sd->psize, &sd->repair_addr);
+    if (sd->gso)
+        sb_enable_gso(rx->sb, false);
+    rx->unicast_sb = sb_init(sd->batch_size, sd->psize, &sd->mcast_addr);
+
+    rx->requested_nums = NULL;
+    rx->arr_size = 0;
+    rx->deadline_ns = NO_DEADLINE;
+    rx->resume_ns = NO_DEADLINE;
+}
+
+static void rx_free(rexmitter *rx) {
+    sb_free(rx->sb);
+    sb_free(rx->unicast_sb);
+    free(rx->requested_nums);
+}
+
+/**
+ * Adds the @p pack to the batches of @p rx: to the unicast one for each
+ * receiver that asked for it if they are few enough, to the multicast one
+ * otherwise. Flushes the unicast batch when it fills up.
+ * @returns number of datagrams added
+ */
+static uint64_t rx_add(sender_data *sd, rexmitter *rx,
+                       const struct audio_pack *pack, const rexmit_info *info) {
+    struct sockaddr_in receiver_addr = sd->repair_addr;
+
+    if (info->n_requesters == 0 || info->n_requesters > sd->unicast_threshold) {
+        sb_add(rx->sb, pack);
+        return 1;
+    }
+
+    // Receivers listen for packs on the station's port on all interfaces.
+    for (uint32_t i = 0; i < info->n_requesters; i++) {
+        receiver_addr.sin_addr = info->requesters[i];
+        sb_add_to(rx->unicast_sb, pack, &receiver_addr);
+        if (sb_is_full(rx->unicast_sb))
+            sb_flush(rx->unicast_sb, sd->mcast_send_sock_fd, NULL);
+    }
+    atomic_fetch_add(&sd->rexmit_stats.unicast, info->n_requesters);
+
+    return info->n_requesters;
+}
+
+/**
+ * Sends packs requested for retransmission since the last call straight
+ * from their rexmit queue slots, the ones closest to eviction first. Packs
+ * retransmitted within the holdoff are skipped. Requests over the budget
+ * are put back into the queue until @p rx->resume_ns. The queue is
+ * guarded for one batch at a time, so that live packs are not held up for
+ * long.
+ * @returns number of packs sent
+ */
+static uint64_t retransmit_requested(sender_data *sd, rexmitter *rx,
+                                     uint64_t now) {
+    struct audio_pack pack;
+    rexmit_info info;
+    uint64_t n_packs = rq_get_requests(sd->rq, &rx->requested_nums,
+                                       &rx->arr_size);
+    uint64_t n_sent = 0;
+    uint64_t n_dgrams;
+    uint64_t n_suppressed = 0;
+    uint64_t nacks = 0;
+    uint64_t i = 0;
+
+    pack.session_id = htobe64(sd->session_id);
+    rx->resume_ns = NO_DEADLINE;
+
+    while (i < n_packs) {
+        if (sd->rexmit_pacer && pacer_ready_ns(sd->rexmit_pacer) > now) {
+            rq_return_requests(sd->rq, rx->requested_nums + i, n_packs - i);
+            atomic_fetch_add(&sd->rexmit_stats.deferred, n_packs - i);
+            rx->resume_ns = pacer_ready_ns(sd->rexmit_pacer);
+            break;
+        }
+
+        rq_read_lock(sd->rq);
+        n_dgrams = 0;
+        for (; i < n_packs && !sb_is_full(rx->sb); i++) {
+            pack.audio_data = rq_peek_pack(sd->rq, rx->requested_nums[i]);
+            if (!pack.audio_data)
+                continue;
+            if (!rq_mark_rexmit(sd->rq, rx->requested_nums[i], now,
+                                sd->rexmit_holdoff_ns, &info)) {
+                n_suppressed++;
+                continue;
+            }
+            nacks += info.n_nacks;
+            pack.first_byte_num = htobe64(rx->requested_nums[i]);
+            n_dgrams += rx_add(sd, rx, &pack, &info);
+            n_sent++;
+        }
+        if (sd->rexmit_pacer)
+            pacer_consume(sd->rexmit_pacer, n_dgrams * sd->psize);
+        sb_flush(rx->sb, sd->mcast_send_sock_fd, NULL);
+        sb_flush(rx->unicast_sb, sd->mcast_send_sock_fd, NULL);
+        rq_read_unlock(sd->rq);
+    }
+
+    atomic_fetch_add(&sd->rexmit_stats.sent, n_sent);
+    atomic_fetch_add(&sd->rexmit_stats.nacks, nacks);
+    atomic_fetch_add(&sd->rexmit_stats.suppressed, n_suppressed);
+
+    return n_sent;
+}
+
+/**
+ * Handles new requests signalled by the rexmit queue's request fd. They
+ * are coalesced until RTIME passes, unless the sender serves the first
+ * request after a quiet period at once.
+ */
+static void rx_on_request(sender_data *sd, rexmitter *rx, uint64_t now) {
+    eventfd_t count;
+
+    (void) eventfd_read(rq_request_fd(sd->rq), &count);
+
+    if (rx->deadline_ns != NO_DEADLINE)
+        return; // coalesced with the pending ones
+
+    if (sd->rexmit_immediate)
+        retransmit_requested(sd, rx, now);
+    rx->deadline_ns = min(now + sd->rtime_u * 1000, rx->resume_ns);
+}
+
+/**
+ * Serves requests coalesced until the deadline. In the immediate mode the
+ * requests keep being coalesced for as long as they keep coming. Requests
+ * put off for lack of budget are served as soon as there is budget.
+ */
+static void rx_on_deadline(sender_data *sd, rexmitter *rx, uint64_t now) {
+    uint64_t n_sent = retransmit_requested(sd, rx, now);
+
+    if (sd->rexmit_immediate && n_sent > 0)
+        rx->deadline_ns = now + sd->rtime_u * 1000;
+    else
+        rx->deadline_ns = NO_DEADLINE;
+    rx->deadline_ns = min(rx->deadline_ns, rx->resume_ns);
+}
+
 static void *pack_retransmitter(void *args) {
     sender_data *sd = args;
+    rexmitter rx;
+    rx_init(&rx, sd);
 
-    int send_sock_fd = open_socket();
-    bind_socket(send_sock_fd, 0); // bind to any port
+    struct pollfd pfd = {.fd = rq_request_fd(sd->rq), .events = POLLIN};
+    struct timespec timeout;
+    uint64_t now;
 
-    byte *audio_data = malloc(sd->psize);
+    // Sleeps until requests come or the coalesced ones are due.
+    while (!is_finished(sd)) {
+        now = monotonic_nsec();
+        if (rx.deadline_ns <= now)
+            rx_on_deadline(sd, &rx, now);
 
+        if (rx.deadline_ns != NO_DEADLINE) {
+            timeout.tv_sec = (rx.deadline_ns - now) / NSEC_PER_SEC;
+            timeout.tv_nsec = (rx.deadline_ns - now) % NSEC_PER_SEC;
+        }
+        if (ppoll(&pfd, 1, rx.deadline_ns == NO_DEADLINE ? NULL : &timeout,
+                  NULL) > 0 && !is_finished(sd))
+            rx_on_request(sd, &rx, monotonic_nsec());
+    }
+
+    rx_free(&rx);
+
+    return 0;
+}
+
+/** A station served by the event loop of a multi-station sender. */
+struct station {
+    sender_data *sd;
+
+    send_batch *live;               /**< live packs waiting to be sent */
+    rexmitter rx;
+
+    byte *slot;           /**< slot the next streamed pack is read into */
+    uint64_t slot_fbn;
+    uint64_t slot_filled;
+    bool polled;       /**< whether the streamed input is polled for now */
+
+    bool eof;
+
+    rexmit_request *requests; /**< for the station in a control batch */
+    uint64_t n_requests;
+};
+
+typedef struct station station;
+
+// epoll_event data of the control socket, the timer, the stations' inputs
+// and their rexmit queues' request fds.
+#define EV_CTRL 0
+#define EV_TIMER 1
+#define EV_STATION(i) (2 * (i) + 2)
+#define EV_REXMIT(i) (2 * (i) + 3)
+
+static void station_init(station *st, sender_data *sd) {
+    st->sd = sd;
+
+    st->live = sb_init(sd->batch_size, sd->psize, &sd->mcast_addr);
+    if (sd->gso)
+        sb_enable_gso(st->live, sd->zt != NULL);
+    rx_init(&st->rx, sd);
+
+    st->slot = NULL;
+    st->polled = false;
+
+    st->eof = false;
+
+    st->requests = calloc(CTRL_BATCH_SIZE, sizeof(rexmit_request));
+    if (!st->requests)
+        fatal("calloc");
+    st->n_requests = 0;
+}
+
+static void station_free(station *st) {
+    sb_free(st->live);
+    rx_free(&st->rx);
+    free(st->requests);
+    sd_free(st->sd);
+}
+
+static void set_polled(station *st, int epoll_fd, uint64_t i, bool polled) {
+    struct epoll_event ev = {.events = polled ? EPOLLIN : 0,
+                             .data.u64 = EV_STATION(i)};
+
+    if (st->polled != polled)
+        CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, st->sd->input_fd, &ev));
+    st->polled = polled;
+}
+
+/**
+ * Reads whatever the streamed input of station @p i has ready, until its
+ * live batch is full. Input is not polled while the batch stays full.
+ */
+static void station_read(station *st, int epoll_fd, uint64_t i) {
+    sender_data *sd = st->sd;
+    struct audio_pack pack;
+    ssize_t read_size;
+
+    while (!sb_is_full(st->live)) {
+        if (!st->slot) {
+            st->slot = rq_reserve_slot(sd->rq, &st->slot_fbn);
+            st->slot_filled = 0;
+        }
+
+        read_size = read(sd->input_fd, st->slot + st->slot_filled,
+                         sd->psize - st->slot_filled);
+        if (read_size < 0 && errno == EINTR)
+            continue;
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (read_size <= 0) {
+            // A partial pack at the end of input is dropped.
+            CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sd->input_fd, NULL));
+            st->polled = false;
+            st->eof = true;
+            return;
+        }
+
+        st->slot_filled += read_size;
+        if (st->slot_filled == sd->psize) {
+            pack.session_id = htobe64(sd->session_id);
+            pack.first_byte_num = htobe64(st->slot_fbn);
+            pack.audio_data = st->slot;
+            sb_add(st->live, &pack);
+            st->slot = NULL;
+        }
+    }
+
+    set_polled(st, epoll_fd, i, false);
+}
+
+/**
+ * Fills the live batch of a station sending a memory-mapped file.
+ */
+static void station_fill_mapped(station *st) {
+    sender_data *sd = st->sd;
     struct audio_pack pack;
+    uint64_t first_byte_num;
+
+    pack.session_id = htobe64(sd->session_id);
 
-    uint64_t *requested_nums = NULL;
-    uint64_t arr_size = 0;
+    while (!st->eof && !sb_is_full(st->live)) {
+        pack.audio_data = rq_reserve_slot(sd->rq, &first_byte_num);
+        if (!sd->loop && first_byte_num / sd->psize == sd->input_packs)
+            st->eof = true;
+        else {
+            pack.first_byte_num = htobe64(first_byte_num);
+            sb_add(st->live, &pack);
+        }
+    }
+}
+
+/**
+ * @returns time at which the station has live packs to send;
+ * @p NO_DEADLINE if it has none
+ */
+static uint64_t station_live_deadline(station *st) {
+    sender_data *sd = st->sd;
+    uint64_t deadline;
+
+    if (sd->input_map)
+        return st->eof ? NO_DEADLINE : pacer_ready_ns(sd->pacer);
+
+    if (st->live->count == 0)
+        return NO_DEADLINE;
+
+    if (st->eof || sb_is_full(st->live))
+        deadline = 0;
+    else
+        deadline = st->live->first_added_ns + sd->batch_delay_ns;
+
+    if (sd->pacer)
+        deadline = max(deadline, pacer_ready_ns(sd->pacer));
+
+    return deadline;
+}
+
+static bool station_done(station *st) {
+    return st->eof && st->live->count == 0;
+}
+
+/**
+ * Sends whatever packs of station @p i are due at @p now.
+ */
+static void station_run(station *st, int epoll_fd, uint64_t i, uint64_t now) {
+    sender_data *sd = st->sd;
+
+    if (station_live_deadline(st) <= now) {
+        if (sd->input_map)
+            station_fill_mapped(st);
+        flush_live_batch(sd, st->live);
+        if (!sd->input_map && !st->eof)
+            set_polled(st, epoll_fd, i, true);
+    }
+
+    if (st->rx.deadline_ns <= now)
+        rx_on_deadline(sd, &st->rx, now);
+}
+
+/**
+ * Answers all messages waiting on the control socket, a batch at a time.
+ * LOOKUP is answered with a REPLY for every station. REXMIT does not tell
+ * which station it is meant for, and every station numbers its bytes from
+ * 0, so it is ignored: serving it would multicast repairs on every
+ * station. All the REPLYs advertise REXMIT_BIN, which goes to the station
+ * of its session only, so its requesters are known. Each station gets the
+ * requests of a batch at once, before LOOKUPs of the batch are answered.
+ */
+static void serve_ctrl(int ctrl_sock_fd, station *stations,
+                       uint64_t n_stations, ctrl_batch *cb,
+                       lookup_limiter *ll) {
+    uint64_t n_msgs;
     uint64_t n_packs;
+    uint64_t session_id;
+    uint64_t psize;
+    uint64_t now;
+    char *msg;
+    rexmit_request *req;
+
+    while ((n_msgs = cb_recv(cb, ctrl_sock_fd)) > 0) {
+        now = monotonic_nsec();
+        for (uint64_t i = 0; i < n_stations; i++)
+            stations[i].n_requests = 0;
+
+        for (uint64_t m = 0; m < n_msgs; m++) {
+            msg = cb_msg(cb, m);
+
+            switch (what_message(msg)) {
+                case LOOKUP:
+                    if (!ll_allow(ll, &cb->addrs[m], now))
+                        break;
+                    for (uint64_t i = 0; i < n_stations; i++)
+                        cb_add_reply(cb, m, stations[i].sd->reply,
+                                     stations[i].sd->reply_size);
+                    break;
+                case REXMIT_BIN:
+                    if (parse_rexmit_bin(msg, cb->msgs[m].msg_len, &session_id,
+                                         &psize, cb_next_packs(cb),
+                                         CTRL_MAX_PACKS, &n_packs) != 0)
+                        break;
+                    cb_add_request(cb, n_packs, &cb->addrs[m]);
+                    req = &cb->requests[cb->n_requests - 1];
+                    for (uint64_t i = 0; i < n_stations; i++)
+                        if (stations[i].sd->session_id == session_id &&
+                            stations[i].sd->psize == psize)
+                            stations[i].requests[stations[i].n_requests++] =
+                                    *req;
+                    break;
+            }
+        }
 
-    while (!is_finished(sd)) {
-        if ((n_packs = rq_get_requests(sd->rq, &requested_nums,
-                                       &arr_size)) > 0)
-            for (uint64_t i = 0; i < n_packs; i++)
-                if (rq_get_pack(sd->rq, audio_data, requested_nums[i])) {
-                    pack.first_byte_num = htobe64(requested_nums[i]);
-                    pack.session_id = htobe64(sd->session_id);
-                    pack.audio_data = audio_data;
-                    send_pack(sd->mcast_send_sock_fd, &sd->mcast_addr, &pack,
-                              sd);
-                }
-        usleep(sd->rtime_u);
+        for (uint64_t i = 0; i < n_stations; i++)
+            rq_add_request_batch(stations[i].sd->rq, stations[i].requests,
+                                 stations[i].n_requests);
+        cb_send_replies(cb, ctrl_sock_fd);
     }
+}
 
-    free(audio_data);
+/**
+ * Serves all stations listed in the stations file of @p opts from a single
+ * thread. Inputs and the control socket are polled with epoll, and a
+ * timerfd wakes the loop when a batch, a paced send or a retransmission
+ * falls due. Returns once every station has sent its whole input.
+ */
+static void serve_stations(sender_opts *opts) {
+    uint64_t n_stations;
+    sender_data **sds = read_stations(opts->stations_path, &n_stations);
+    station *stations = malloc(n_stations * sizeof(station));
+    struct epoll_event *events = malloc(EV_STATION(n_stations) *
+                                        sizeof(struct epoll_event));
+    ctrl_batch *cb = cb_init(false, n_stations);
+    lookup_limiter *ll = ll_init(opts->lookup_interval * NSEC_PER_MSEC);
+    if (!stations || !events)
+        fatal("malloc");
+
+    int epoll_fd = epoll_create1(0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    int ctrl_sock_fd = create_socket(opts->ctrl_port);
+    ENSURE(epoll_fd >= 0 && timer_fd >= 0);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.u64 = EV_CTRL};
+    CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ctrl_sock_fd, &ev));
+    ev.data.u64 = EV_TIMER;
+    CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev));
+
+    for (uint64_t i = 0; i < n_stations; i++) {
+        station_init(&stations[i], sds[i]);
+        ev.data.u64 = EV_REXMIT(i);
+        CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD,
+                              rq_request_fd(sds[i]->rq), &ev));
+        if (sds[i]->input_map)
+            continue;
+
+        if (sds[i]->zt)
+            fatal("Zerocopy (-z) needs a file input in a station");
+        CHECK_ERRNO(fcntl(sds[i]->input_fd, F_SETFL,
+                          fcntl(sds[i]->input_fd, F_GETFL) | O_NONBLOCK));
+        ev.data.u64 = EV_STATION(i);
+        CHECK_ERRNO(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sds[i]->input_fd, &ev));
+        stations[i].polled = true;
+    }
+    free(sds);
+
+    struct itimerspec timer;
+    uint64_t expirations;
+    uint64_t now;
+    uint64_t deadline;
+    uint64_t n_live = n_stations;
+    uint64_t stats_ns = NO_DEADLINE;
+    int n_events;
+
+    if (opts->stats_interval > 0)
+        stats_ns = monotonic_nsec() + opts->stats_interval * NSEC_PER_SEC;
+
+    while (n_live > 0) {
+        deadline = stats_ns;
+        for (uint64_t i = 0; i < n_stations; i++) {
+            deadline = min(deadline, station_live_deadline(&stations[i]));
+            deadline = min(deadline, stations[i].rx.deadline_ns);
+        }
 
-    return 0;
+        // An absolute expiration of 0 would disarm the timer.
+        deadline = max(deadline, 1UL);
+        memset(&timer, 0, sizeof(timer));
+        timer.it_value.tv_sec = deadline / NSEC_PER_SEC;
+        timer.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+        CHECK_ERRNO(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer,
+                                    NULL));
+
+        n_events = epoll_wait(epoll_fd, events, EV_STATION(n_stations), -1);
+        if (n_events < 0 && errno == EINTR)
+            continue;
+        ENSURE(n_events >= 0);
+
+        for (int e = 0; e < n_events; e++) {
+            if (events[e].data.u64 == EV_CTRL)
+                serve_ctrl(ctrl_sock_fd, stations, n_stations, cb, ll);
+            else if (events[e].data.u64 == EV_TIMER)
+                (void) !read(timer_fd, &expirations, sizeof(expirations));
+            else {
+                uint64_t i = (events[e].data.u64 - EV_STATION(0)) / 2;
+
+                if (events[e].data.u64 == EV_STATION(i))
+                    station_read(&stations[i], epoll_fd, i);
+                else
+                    rx_on_request(stations[i].sd, &stations[i].rx,
+                                  monotonic_nsec());
+            }
+        }
+
+        now = monotonic_nsec();
+        if (stats_ns <= now) {
+            for (uint64_t i = 0; i < n_stations; i++)
+                print_rexmit_stats(stations[i].sd);
+            stats_ns = now + opts->stats_interval * NSEC_PER_SEC;
+        }
+
+        n_live = 0;
+        for (uint64_t i = 0; i < n_stations; i++) {
+            station_run(&stations[i], epoll_fd, i, now);
+            if (!station_done(&stations[i]))
+                n_live++;
+        }
+    }
+
+    for (uint64_t i = 0; i < n_stations; i++)
+        station_free(&stations[i]);
+
+    CHECK_ERRNO(close(ctrl_sock_fd));
+    CHECK_ERRNO(close(timer_fd));
+    CHECK_ERRNO(close(epoll_fd));
+    free(stations);
+    free(events);
+    cb_free(cb);
+    ll_free(ll);
+    free(opts);
 }
 
 int main(int argc, char **argv) {
-    sender_data *sd = sd_init(argc, argv);
+    sender_opts *opts = get_sender_opts(argc, argv);
 
+    if (opts->stations_path[0] != '\0') {
+        serve_stations(opts);
+        return 0;
+    }
+
+    sender_data *sd = sd_init(opts, time(NULL));
+
+    pthread_t reader;
     pthread_t sender;
-    pthread_t listener;
+    pthread_t listeners[MAX_CTRL_LISTENERS];
+    ctrl_listener_args listener_args[MAX_CTRL_LISTENERS];
     pthread_t retransmitter;
+    pthread_t reporter;
 
+    CHECK_ERRNO(pthread_create(&reader, NULL, pack_reader, sd));
     CHECK_ERRNO(pthread_create(&sender, NULL, pack_sender, sd));
-    CHECK_ERRNO(pthread_create(&listener, NULL, ctrl_listener, sd));
+    for (uint64_t i = 0; i < sd->ctrl_listeners; i++) {
+        listener_args[i].sd = sd;
+        listener_args[i].answers_broadcasts = i == 0;
+        CHECK_ERRNO(pthread_create(&listeners[i], NULL, ctrl_listener,
+                                   &listener_args[i]));
+    }
     CHECK_ERRNO(pthread_create(&retransmitter, NULL, pack_retransmitter, sd));
+    if (sd->stats_interval > 0)
+        CHECK_ERRNO(pthread_create(&reporter, NULL, stats_reporter, sd));
 
+    CHECK_ERRNO(pthread_join(reader, NULL));
     CHECK_ERRNO(pthread_join(sender, NULL));
-    CHECK_ERRNO(pthread_join(listener, NULL));
+    for (uint64_t i = 0; i < sd->ctrl_listeners; i++)
+        CHECK_ERRNO(pthread_join(listeners[i], NULL));
     CHECK_ERRNO(pthread_join(retransmitter, NULL));
+    if (sd->stats_interval > 0)
+        CHECK_ERRNO(pthread_join(reporter, NULL));
 
     sd_free(sd);
 
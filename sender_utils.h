@@ -5,28 +5,733 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
 #include <time.h>
+#include <stdatomic.h>
 #include "err.h"
 #include "rexmit_queue.h"
+#include "pacer.h"
+#include "input_ring.h"
+#include "ctrl_protocol.h"
 #include "opts.h"
 
+/**
+ * Reads from @p fd until @p data holds a full pack of @p pack_size bytes.
+ * @returns true if a full pack was read; false on end of input
+ */
+inline static bool read_pack(int fd, byte *data, uint64_t pack_size) {
+    uint64_t filled = 0;
+    ssize_t read_size;
+
+    while (filled < pack_size) {
+        read_size = read(fd, data + filled, pack_size - filled);
+        if (read_size < 0 && errno == EINTR)
+            continue;
+        if (read_size <= 0)
+            return false;
+        filled += read_size;
+    }
+
+    return true;
+}
+
+/**
+ * Maps the whole regular file open as @p fd into memory for reading.
+ * @param fd - descriptor of the file
+ * @param path - path to the file, for error messages
+ * @param size - pointer to the size of the file
+ * @returns pointer to the mapping
+ */
+inline static byte *map_file(int fd, const char *path, uint64_t *size) {
+    struct stat st;
+    byte *map;
+
+    CHECK_ERRNO(fstat(fd, &st));
+    if (st.st_size == 0)
+        fatal("Empty file: %s", path);
+    *size = st.st_size;
+
+    map = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        fatal("Cannot map %s: %s", path, strerror(errno));
+
+    return map;
+}
+
+/**
+ * Accounting of MSG_ZEROCOPY sends issued through a socket. The kernel
+ * numbers zerocopy sends of a socket consecutively and reports ranges of
+ * completed ones on the socket's error queue, not necessarily in order. A
+ * single send may carry many datagrams, so the number of datagrams sent is
+ * recorded for each send.
+ */
+struct zerocopy_tracker {
+    int socket_fd;
+
+    uint64_t *dgrams_after;  /**< datagrams sent up to send i, at i % size */
+    uint64_t *done;    /**< bit i % size is set if send i is completed */
+    uint64_t size;
+
+    uint64_t sends;                    /**< number of zerocopy sends issued */
+    uint64_t completed;     /**< sends before this one are all completed */
+    uint64_t dgrams;                     /**< number of datagrams issued */
+};
+
+typedef struct zerocopy_tracker zerocopy_tracker;
+
+/**
+ * Enables MSG_ZEROCOPY on @p socket_fd and initializes its tracker.
+ * @param max_pending - maximum number of not completed sends
+ */
+inline static zerocopy_tracker *zt_init(int socket_fd, uint64_t max_pending) {
+    zerocopy_tracker *zt = malloc(sizeof(zerocopy_tracker));
+    if (!zt)
+        fatal("malloc");
+
+    enable_zerocopy(socket_fd);
+
+    zt->socket_fd = socket_fd;
+    zt->size = max_pending;
+    zt->dgrams_after = calloc(max_pending, sizeof(uint64_t));
+    zt->done = calloc((max_pending + 63) / 64, sizeof(uint64_t));
+    if (!zt->dgrams_after || !zt->done)
+        fatal("calloc");
+    zt->sends = zt->completed = zt->dgrams = 0;
+
+    return zt;
+}
+
+inline static void zt_free(zerocopy_tracker *zt) {
+    free(zt->dgrams_after);
+    free(zt->done);
+    free(zt);
+}
+
+/**
+ * Marks sends with ids from @p lo to @p hi, as reported by the kernel, as
+ * completed, then moves past all the completed sends in order. Ids are the
+ * low 32 bits of send numbers.
+ */
+inline static void zt_complete(zerocopy_tracker *zt, uint32_t lo, uint32_t hi) {
+    uint32_t offset;
+    uint64_t slot;
+
+    for (uint64_t i = 0; i <= (uint32_t) (hi - lo); i++) {
+        // Reports of sends completed already are ignored.
+        offset = lo + (uint32_t) i - (uint32_t) zt->completed;
+        if (offset >= zt->sends - zt->completed)
+            continue;
+        slot = (zt->completed + offset) % zt->size;
+        zt->done[slot / 64] |= 1ULL << (slot % 64);
+    }
+
+    while (zt->completed < zt->sends) {
+        slot = zt->completed % zt->size;
+        if (!(zt->done[slot / 64] & (1ULL << (slot % 64))))
+            break;
+        zt->done[slot / 64] &= ~(1ULL << (slot % 64));
+        zt->completed++;
+    }
+}
+
+/**
+ * Reads completion notifications queued on the tracked socket. If @p block
+ * is set, waits for at least one notification.
+ */
+inline static void zt_reap(zerocopy_tracker *zt, bool block) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+    struct pollfd pfd = {.fd = zt->socket_fd, .events = 0};
+
+    while (true) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(zt->socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR)
+                continue;
+            ENSURE(errno == EAGAIN || errno == EWOULDBLOCK);
+            if (!block)
+                return;
+            // POLLERR is reported once the error queue is not empty.
+            if (poll(&pfd, 1, -1) < 0)
+                ENSURE(errno == EINTR);
+            continue;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+                continue;
+            serr = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 ||
+                serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // Sends ee_info to ee_data are completed, though earlier ones
+            // may not be yet.
+            zt_complete(zt, serr->ee_info, serr->ee_data);
+        }
+        block = false;
+    }
+}
+
+/**
+ * Records a zerocopy send of @p n_dgrams datagrams, that was just issued.
+ */
+inline static void zt_record(zerocopy_tracker *zt, uint64_t n_dgrams) {
+    while (zt->sends - zt->completed >= zt->size)
+        zt_reap(zt, true);
+
+    zt->dgrams += n_dgrams;
+    zt->dgrams_after[zt->sends++ % zt->size] = zt->dgrams;
+}
+
+/**
+ * Returns the number of datagrams the kernel is known to be done with.
+ */
+inline static uint64_t zt_completed_dgrams(zerocopy_tracker *zt) {
+    if (zt->completed == 0)
+        return 0;
+    return zt->dgrams_after[(zt->completed - 1) % zt->size];
+}
+
+/**
+ * A batch of datagrams sent to a single address with one sendmmsg() call.
+ * Each datagram is gathered from its header and its audio data, which has
+ * to stay in place until the batch is flushed.
+ */
+struct send_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;                  /**< header and data iovec pairs */
+    struct audio_pack *packs;       /**< headers of collected datagrams */
+
+    struct sockaddr_in dest_address;
+    struct sockaddr_in *dest_addresses; /**< of datagrams sent elsewhere */
+
+    uint64_t capacity;
+    uint64_t count;                /**< number of datagrams collected */
+    uint64_t psize;
+    uint64_t first_added_ns; /**< time the oldest datagram was added */
+
+    /** maximum number of datagrams handed to the kernel in a single UDP GSO
+     * send; 0 if GSO is not used */
+    uint64_t gso_segs;
+};
+
+typedef struct send_batch send_batch;
+
+inline static send_batch *sb_init(uint64_t capacity, uint64_t psize,
+                                  const struct sockaddr_in *dest_address) {
+    send_batch *sb = malloc(sizeof(send_batch));
+    if (!sb)
+        fatal("malloc");
+
+    sb->capacity = capacity;
+    sb->count = 0;
+    sb->psize = psize;
+    sb->first_added_ns = 0;
+    sb->gso_segs = 0;
+    sb->dest_address = *dest_address;
+
+    sb->msgs = calloc(capacity, sizeof(struct mmsghdr));
+    sb->iovs = calloc(2 * capacity, sizeof(struct iovec));
+    sb->packs = calloc(capacity, sizeof(struct audio_pack));
+    sb->dest_addresses = calloc(capacity, sizeof(struct sockaddr_in));
+    if (!sb->msgs || !sb->iovs || !sb->packs || !sb->dest_addresses)
+        fatal("calloc");
+
+    for (uint64_t i = 0; i < capacity; i++) {
+        // session_id and first_byte_num of the packed audio_pack struct are
+        // laid out exactly like the datagram header.
+        sb->iovs[2 * i].iov_base = &sb->packs[i];
+        sb->iovs[2 * i].iov_len = 16;
+        sb->iovs[2 * i + 1].iov_len = psize;
+        sb->msgs[i].msg_hdr.msg_iov = &sb->iovs[2 * i];
+        sb->msgs[i].msg_hdr.msg_iovlen = 2;
+        sb->msgs[i].msg_hdr.msg_name = &sb->dest_address;
+        sb->msgs[i].msg_hdr.msg_namelen = sizeof(sb->dest_address);
+    }
+
+    return sb;
+}
+
+inline static void sb_free(send_batch *sb) {
+    free(sb->msgs);
+    free(sb->iovs);
+    free(sb->packs);
+    free(sb->dest_addresses);
+    free(sb);
+}
+
+inline static bool sb_is_full(const send_batch *sb) {
+    return sb->count == sb->capacity;
+}
+
+/**
+ * Appends the @p pack to the batch. Assumes the batch is not full. Audio
+ * data of the pack is not copied.
+ */
+inline static void sb_add(send_batch *sb, const struct audio_pack *pack) {
+    sb->packs[sb->count] = *pack;
+    sb->iovs[2 * sb->count + 1].iov_base = pack->audio_data;
+    sb->msgs[sb->count].msg_hdr.msg_name = &sb->dest_address;
+
+    if (sb->count++ == 0)
+        sb->first_added_ns = monotonic_nsec();
+}
+
+/**
+ * Appends the @p pack to the batch, to be sent to @p dest_address instead
+ * of the batch's destination. Assumes the batch is not full and does not
+ * use GSO.
+ */
+inline static void sb_add_to(send_batch *sb, const struct audio_pack *pack,
+                             const struct sockaddr_in *dest_address) {
+    sb->dest_addresses[sb->count] = *dest_address;
+    sb_add(sb, pack);
+    sb->msgs[sb->count - 1].msg_hdr.msg_name =
+            &sb->dest_addresses[sb->count - 1];
+}
+
+// Limits of a single UDP GSO send: UDP_MAX_SEGMENTS of the kernel and the
+// maximum size of an IPv4 datagram.
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_SIZE UDP_IPV4_DATASIZE
+#define GSO_MAX_FRAGS 17
+
+/**
+ * Makes the batch send its datagrams with UDP GSO: runs of headers and
+ * audio data are handed to the kernel in one sendmsg() call, which splits
+ * them into datagrams of PSIZE + 16 bytes. Does nothing if not even two
+ * datagrams fit into a GSO send.
+ * @param zerocopy - whether the batch is sent with MSG_ZEROCOPY, in which
+ * case each iovec of a GSO send takes up one of at most GSO_MAX_FRAGS skb
+ * fragments
+ */
+inline static void sb_enable_gso(send_batch *sb, bool zerocopy) {
+    uint64_t segs = min((uint64_t) GSO_MAX_SEGMENTS,
+                        GSO_MAX_SIZE / (sb->psize + 16));
+    if (zerocopy)
+        // Header, audio data and a page boundary crossed by audio data.
+        segs = min(segs, (uint64_t) GSO_MAX_FRAGS / 3);
+    sb->gso_segs = segs >= 2 ? segs : 0;
+}
+
+/**
+ * Sends @p n_dgrams datagrams of the batch starting from @p first with a
+ * single UDP GSO send.
+ * @returns false if the kernel does not support GSO for the socket
+ */
+inline static bool _sb_send_gso(send_batch *sb, int socket_fd, int flags,
+                                uint64_t first, uint64_t n_dgrams) {
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t sent_size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &sb->dest_address;
+    msg.msg_namelen = sizeof(sb->dest_address);
+    msg.msg_iov = &sb->iovs[2 * first];
+    msg.msg_iovlen = 2 * n_dgrams;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *((uint16_t *) CMSG_DATA(cmsg)) = sb->psize + 16;
+
+    do {
+        errno = 0;
+        sent_size = sendmsg(socket_fd, &msg, flags);
+    } while (sent_size < 0 && errno == EINTR);
+
+    if (sent_size < 0 && (errno == EIO || errno == EINVAL ||
+                          errno == ENOPROTOOPT || errno == EOPNOTSUPP ||
+                          errno == EMSGSIZE))
+        return false;
+
+    ENSURE(sent_size == (ssize_t) (n_dgrams * (sb->psize + 16)));
+    return true;
+}
+
+/**
+ * Sends all datagrams collected in the batch through @p socket_fd and
+ * empties the batch. Uses UDP GSO if enabled, falling back to sendmmsg()
+ * for good once the kernel refuses it.
+ * @param zt - tracker of @p socket_fd if datagrams are to be sent with
+ * MSG_ZEROCOPY; NULL otherwise
+ */
+inline static void sb_flush(send_batch *sb, int socket_fd,
+                            zerocopy_tracker *zt) {
+    int flags = zt ? MSG_ZEROCOPY : 0;
+    uint64_t sent = 0;
+    uint64_t n_dgrams;
+    int res;
+
+    while (sent < sb->count && sb->gso_segs > 0) {
+        n_dgrams = min(sb->count - sent, sb->gso_segs);
+        if (_sb_send_gso(sb, socket_fd, flags, sent, n_dgrams)) {
+            sent += n_dgrams;
+            if (zt)
+                zt_record(zt, n_dgrams);
+        } else
+            sb->gso_segs = 0;
+    }
+
+    while (sent < sb->count) {
+        errno = 0;
+        res = sendmmsg(socket_fd, sb->msgs + sent, sb->count - sent, flags);
+        if (res < 0 && errno == EINTR)
+            continue;
+        ENSURE(res > 0);
+
+        for (int i = 0; i < res; i++) {
+            ENSURE(sb->msgs[sent + i].msg_len == sb->psize + 16);
+            if (zt)
+                zt_record(zt, 1);
+        }
+        sent += res;
+    }
+
+    sb->count = 0;
+}
+
+// Maximum number of control datagrams received with a single syscall.
+#define CTRL_BATCH_SIZE 32
+
+// Maximum number of packs taken from a single REXMIT.
+#define CTRL_MAX_PACKS (CTRL_BUF_SIZE / sizeof(uint64_t))
+
+/**
+ * A batch of control datagrams received with one recvmmsg() call, and the
+ * requests for retransmission parsed from them so far.
+ */
+struct ctrl_batch {
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *bufs;          /**< CTRL_BATCH_SIZE buffers of CTRL_BUF_SIZE bytes */
+    struct sockaddr_in *addrs;               /**< senders of the datagrams */
+    char *cmsgs;       /**< IP_PKTINFO of the datagrams; NULL if not asked */
+
+    uint64_t *packs;    /**< CTRL_MAX_PACKS numbers for every datagram */
+    rexmit_request *requests;
+    uint64_t n_requests;
+    uint64_t n_packs;
+
+    struct mmsghdr *replies;   /**< REPLYs to send back, see cb_add_reply() */
+    struct iovec *reply_iovs;
+    uint64_t n_replies;
+    uint64_t max_replies;
+};
+
+typedef struct ctrl_batch ctrl_batch;
+
+#define CTRL_CMSG_SIZE CMSG_SPACE(sizeof(struct in_pktinfo))
+
+/**
+ * @param pktinfo - whether the destination of each datagram is kept, see
+ * cb_is_broadcast(); the socket must have IP_PKTINFO enabled then
+ * @param n_stations - number of REPLYs a LOOKUP is answered with
+ */
+inline static ctrl_batch *cb_init(bool pktinfo, uint64_t n_stations) {
+    ctrl_batch *cb = malloc(sizeof(ctrl_batch));
+    if (!cb)
+        fatal("malloc");
+
+    cb->msgs = calloc(CTRL_BATCH_SIZE, sizeof(struct mmsghdr));
+    cb->iovs = calloc(CTRL_BATCH_SIZE, sizeof(struct iovec));
+    cb->bufs = malloc(CTRL_BATCH_SIZE * CTRL_BUF_SIZE);
+    cb->addrs = calloc(CTRL_BATCH_SIZE, sizeof(struct sockaddr_in));
+    cb->cmsgs = pktinfo ? calloc(CTRL_BATCH_SIZE, CTRL_CMSG_SIZE) : NULL;
+    cb->packs = malloc(CTRL_BATCH_SIZE * CTRL_MAX_PACKS * sizeof(uint64_t));
+    cb->requests = calloc(CTRL_BATCH_SIZE, sizeof(rexmit_request));
+    cb->max_replies = CTRL_BATCH_SIZE * n_stations;
+    cb->replies = calloc(cb->max_replies, sizeof(struct mmsghdr));
+    cb->reply_iovs = calloc(cb->max_replies, sizeof(struct iovec));
+    if (!cb->msgs || !cb->iovs || !cb->bufs || !cb->addrs ||
+        (pktinfo && !cb->cmsgs) || !cb->packs || !cb->requests ||
+        !cb->replies || !cb->reply_iovs)
+        fatal("calloc");
+
+    for (uint64_t i = 0; i < cb->max_replies; i++) {
+        cb->replies[i].msg_hdr.msg_iov = &cb->reply_iovs[i];
+        cb->replies[i].msg_hdr.msg_iovlen = 1;
+        cb->replies[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    for (uint64_t i = 0; i < CTRL_BATCH_SIZE; i++) {
+        // One byte is left for the NUL that text messages are parsed up to.
+        cb->iovs[i].iov_base = cb->bufs + i * CTRL_BUF_SIZE;
+        cb->iovs[i].iov_len = CTRL_BUF_SIZE - 1;
+        cb->msgs[i].msg_hdr.msg_iov = &cb->iovs[i];
+        cb->msgs[i].msg_hdr.msg_iovlen = 1;
+        cb->msgs[i].msg_hdr.msg_name = &cb->addrs[i];
+    }
+
+    cb->n_requests = 0;
+    cb->n_packs = 0;
+    cb->n_replies = 0;
+
+    return cb;
+}
+
+inline static void cb_free(ctrl_batch *cb) {
+    free(cb->msgs);
+    free(cb->iovs);
+    free(cb->bufs);
+    free(cb->addrs);
+    free(cb->cmsgs);
+    free(cb->packs);
+    free(cb->requests);
+    free(cb->replies);
+    free(cb->reply_iovs);
+    free(cb);
+}
+
+/**
+ * Receives the datagrams waiting on @p socket_fd, up to CTRL_BATCH_SIZE,
+ * without blocking, and drops the requests parsed from the previous ones.
+ * Each datagram is followed by a NUL.
+ * @returns number of datagrams received
+ */
+inline static uint64_t cb_recv(ctrl_batch *cb, int socket_fd) {
+    int res;
+
+    for (uint64_t i = 0; i < CTRL_BATCH_SIZE; i++) {
+        cb->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        if (cb->cmsgs) {
+            cb->msgs[i].msg_hdr.msg_control = cb->cmsgs + i * CTRL_CMSG_SIZE;
+            cb->msgs[i].msg_hdr.msg_controllen = CTRL_CMSG_SIZE;
+        }
+    }
+    cb->n_requests = 0;
+    cb->n_packs = 0;
+    cb->n_replies = 0;
+
+    do {
+        res = recvmmsg(socket_fd, cb->msgs, CTRL_BATCH_SIZE, MSG_DONTWAIT,
+                       NULL);
+    } while (res < 0 && errno == EINTR);
+    if (res <= 0)
+        return 0;
+
+    for (int i = 0; i < res; i++)
+        cb->bufs[i * CTRL_BUF_SIZE + cb->msgs[i].msg_len] = '\0';
+
+    return res;
+}
+
+inline static char *cb_msg(ctrl_batch *cb, uint64_t i) {
+    return cb->bufs + i * CTRL_BUF_SIZE;
+}
+
+/**
+ * Tells whether the @p i-th datagram was sent to a broadcast or multicast
+ * address rather than to this host's, as learnt from IP_PKTINFO.
+ */
+inline static bool cb_is_broadcast(ctrl_batch *cb, uint64_t i) {
+    struct cmsghdr *cmsg;
+    struct in_pktinfo *info;
+
+    for (cmsg = CMSG_FIRSTHDR(&cb->msgs[i].msg_hdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&cb->msgs[i].msg_hdr, cmsg))
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            info = (struct in_pktinfo *) CMSG_DATA(cmsg);
+            return info->ipi_addr.s_addr != info->ipi_spec_dst.s_addr;
+        }
+
+    return false;
+}
+
+/**
+ * @returns space for the packs of the next request, for up to
+ * CTRL_MAX_PACKS of them
+ */
+inline static uint64_t *cb_next_packs(ctrl_batch *cb) {
+    return cb->packs + cb->n_packs;
+}
+
+/**
+ * Adds a request of @p n_packs packs written to cb_next_packs().
+ * @param receiver_addr - address of the receiver that issued it; NULL if
+ * unknown
+ */
+inline static void cb_add_request(ctrl_batch *cb, uint64_t n_packs,
+                                  const struct sockaddr_in *receiver_addr) {
+    cb->requests[cb->n_requests].packs = cb_next_packs(cb);
+    cb->requests[cb->n_requests].n_packs = n_packs;
+    cb->requests[cb->n_requests].receiver_addr = receiver_addr;
+    cb->n_requests++;
+    cb->n_packs += n_packs;
+}
+
+/**
+ * Adds @p reply, which has to stay in place until the replies are sent, to
+ * be sent back to the sender of the @p i-th datagram.
+ */
+inline static void cb_add_reply(ctrl_batch *cb, uint64_t i, const char *reply,
+                                uint64_t reply_size) {
+    cb->reply_iovs[cb->n_replies].iov_base = (void *) reply;
+    cb->reply_iovs[cb->n_replies].iov_len = reply_size;
+    cb->replies[cb->n_replies].msg_hdr.msg_name = &cb->addrs[i];
+    cb->n_replies++;
+}
+
+/** Sends all replies added to the batch through @p socket_fd. */
+inline static void cb_send_replies(ctrl_batch *cb, int socket_fd) {
+    uint64_t sent = 0;
+    int res;
+
+    while (sent < cb->n_replies) {
+        errno = 0;
+        res = sendmmsg(socket_fd, cb->replies + sent, cb->n_replies - sent, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        ENSURE(res > 0);
+
+        for (int i = 0; i < res; i++)
+            ENSURE(cb->replies[sent + i].msg_len ==
+                   cb->reply_iovs[sent + i].iov_len);
+        sent += res;
+    }
+
+    cb->n_replies = 0;
+}
+
+// Number of receivers whose last REPLY a lookup_limiter remembers.
+#define LOOKUP_LIMITER_BITS 12
+#define LOOKUP_LIMITER_SLOTS (1 << LOOKUP_LIMITER_BITS)
+
+/**
+ * Limits how often the same receiver is answered a LOOKUP. Receivers are
+ * told apart by address and port, as several may share an address behind
+ * NAT. Receivers whose slots collide forget about each other, so that
+ * they are answered rather than ignored.
+ */
+struct lookup_limiter {
+    uint64_t interval_ns;
+    uint64_t *sources;    /**< address and port of receivers, plus one */
+    uint64_t *replied_ns;  /**< when they were last answered */
+};
+
+typedef struct lookup_limiter lookup_limiter;
+
+/** @param interval_ns - minimum time between REPLYs; 0 for no limit */
+inline static lookup_limiter *ll_init(uint64_t interval_ns) {
+    lookup_limiter *ll = malloc(sizeof(lookup_limiter));
+    if (!ll)
+        fatal("malloc");
+
+    ll->interval_ns = interval_ns;
+    ll->sources = calloc(LOOKUP_LIMITER_SLOTS, sizeof(uint64_t));
+    ll->replied_ns = calloc(LOOKUP_LIMITER_SLOTS, sizeof(uint64_t));
+    if (!ll->sources || !ll->replied_ns)
+        fatal("calloc");
+
+    return ll;
+}
+
+inline static void ll_free(lookup_limiter *ll) {
+    free(ll->sources);
+    free(ll->replied_ns);
+    free(ll);
+}
+
+/**
+ * Tells whether a LOOKUP of @p receiver_addr received at @p now is to be
+ * answered, and records it if so.
+ */
+inline static bool ll_allow(lookup_limiter *ll,
+                            const struct sockaddr_in *receiver_addr,
+                            uint64_t now) {
+    if (ll->interval_ns == 0)
+        return true;
+
+    uint64_t source = ((uint64_t) receiver_addr->sin_addr.s_addr << 16 |
+                       receiver_addr->sin_port) + 1;
+    // Fibonacci hashing spreads consecutive addresses over the slots.
+    uint64_t slot = (source * 0x9e3779b97f4a7c15ULL) >>
+                    (64 - LOOKUP_LIMITER_BITS);
+
+    if (ll->sources[slot] == source &&
+        now - ll->replied_ns[slot] < ll->interval_ns)
+        return false;
+
+    ll->sources[slot] = source;
+    ll->replied_ns[slot] = now;
+    return true;
+}
+
+/** Counters of retransmission requests, for statistics. */
+struct rexmit_stats {
+    _Atomic uint64_t sent;                    /**< packs retransmitted */
+    _Atomic uint64_t nacks;     /**< NACKs served by the retransmissions */
+    _Atomic uint64_t suppressed; /**< requests ignored within the holdoff */
+    _Atomic uint64_t unicast;   /**< datagrams retransmitted unicast */
+    _Atomic uint64_t deferred; /**< requests put off for lack of budget,
+                                * each once per round it waits */
+};
+
+typedef struct rexmit_stats rexmit_stats;
+
 struct sender_data {
     char *sender_name;
     char *mcast_addr_str;
+    char *repair_addr_str; /**< repair group announced in REPLY; NULL if none */
+    char reply[MAX_REPLY_SIZE];    /**< REPLY to LOOKUP, written up front */
+    uint64_t reply_size;
 
     uint16_t port;
     uint16_t ctrl_port;
     uint64_t psize;
     uint64_t fsize;
     uint64_t rtime_u;
+    bool rexmit_immediate;
+    uint64_t rexmit_holdoff_ns;
+    pacer *rexmit_pacer; /**< pacer of retransmissions if budget is capped */
+    uint64_t unicast_threshold;
+    rexmit_stats rexmit_stats;
     uint64_t session_id;
+    uint64_t batch_size;
+    uint64_t batch_delay_ns;
+
+    zerocopy_tracker *zt; /**< tracker of live MSG_ZEROCOPY sends if enabled */
+
+    bool gso;
+
+    pacer *pacer; /**< pacer of live packs if a byte rate is set */
+
+    input_ring *ir; /**< packs read from the input waiting to be sent */
+
+    int input_fd;          /**< input read as a stream unless mapped */
+    byte *input_map;  /**< memory-mapped input file; NULL if read as a stream */
+    uint64_t input_size;
+    uint64_t input_packs;        /**< number of full packs in the file */
+    bool loop;
+
+    uint64_t stats_interval;
 
     int mcast_send_sock_fd;
     struct sockaddr_in mcast_addr;
+    struct sockaddr_in repair_addr; /**< group retransmissions are sent to */
 
     bool finished;
+    int finish_fd; /**< eventfd readable once finished, for pollers */
 
-    char *send_buffer;
+    uint64_t ctrl_listeners;
+    uint64_t lookup_interval_ns;
 
     rexmit_queue *rq;
 
@@ -37,18 +742,39 @@ struct sender_data {
 
 typedef struct sender_data sender_data;
 
-inline static sender_data *sd_init(int argc, char **argv) {
+/**
+ * Sets up the sender described by @p opts, which it takes ownership of.
+ * Packs go through an input ring only if @p opts sets its size.
+ * @param session_id - session_id of the packs sent, unless a session kept
+ * in the rexmit queue file (-F) is resumed
+ */
+inline static sender_data *sd_init(sender_opts *opts, uint64_t session_id) {
     sender_data *sd = malloc(sizeof(sender_data));
-    sender_opts *opts = get_sender_opts(argc, argv);
+    if (!sd)
+        fatal("malloc");
 
     sd->port = opts->port;
     sd->ctrl_port = opts->ctrl_port;
     sd->psize = opts->psize;
     sd->sender_name = opts->sender_name;
     sd->rtime_u = opts->rtime * 1000; // microseconds
+    sd->rexmit_immediate = opts->rexmit_immediate;
+    sd->rexmit_holdoff_ns = opts->rexmit_holdoff * NSEC_PER_MSEC;
+    sd->unicast_threshold = opts->unicast_threshold;
+    atomic_init(&sd->rexmit_stats.sent, 0);
+    atomic_init(&sd->rexmit_stats.nacks, 0);
+    atomic_init(&sd->rexmit_stats.suppressed, 0);
+    atomic_init(&sd->rexmit_stats.unicast, 0);
+    atomic_init(&sd->rexmit_stats.deferred, 0);
     sd->fsize = opts->fsize;
-    sd->session_id = time(NULL);
+    sd->batch_size = opts->batch_size;
+    sd->batch_delay_ns = opts->batch_delay * NSEC_PER_MSEC;
+    sd->session_id = session_id;
     sd->finished = false;
+    sd->finish_fd = eventfd(0, EFD_NONBLOCK);
+    ENSURE(sd->finish_fd >= 0);
+    sd->ctrl_listeners = opts->ctrl_listeners;
+    sd->lookup_interval_ns = opts->lookup_interval * NSEC_PER_MSEC;
 
     sd->mcast_addr_str = opts->mcast_addr_str;
     sd->mcast_send_sock_fd = socket(PF_INET, SOCK_DGRAM, 0);
@@ -56,13 +782,100 @@ inline static sender_data *sd_init(int argc, char **argv) {
                                       sd->port);
     enable_multicast(sd->mcast_send_sock_fd, &sd->mcast_addr);
 
-    sd->send_buffer = calloc(sd->psize + 16, 1);
-    if (!sd->send_buffer)
-        fatal("calloc");
+    sd->repair_addr_str = NULL;
+    sd->repair_addr = sd->mcast_addr;
+    if (opts->repair_addr_str[0] != '\0') {
+        check_address(opts->repair_addr_str);
+        sd->repair_addr_str = opts->repair_addr_str;
+        sd->repair_addr = get_send_address(sd->repair_addr_str, sd->port);
+        ENSURE(IN_MULTICAST(ntohl(sd->repair_addr.sin_addr.s_addr)));
+    }
 
+    sd->gso = opts->gso;
     check_address(opts->mcast_addr_str);
 
-    sd->rq = rq_init(sd->psize, sd->fsize);
+    sd->reply_size = write_reply(sd->reply, sd->mcast_addr_str, sd->port,
+                                 sd->sender_name, sd->repair_addr_str,
+                                 CAP_BINARY_REXMIT);
+
+    sd->ir = opts->input_queue > 0 ? ir_init(opts->input_queue) : NULL;
+    sd->stats_interval = opts->stats_interval;
+
+    sd->input_fd = STDIN_FILENO;
+    sd->input_map = NULL;
+    sd->loop = opts->loop;
+
+    if (opts->input_path[0] != '\0') {
+        struct stat st;
+
+        sd->input_fd = open(opts->input_path, O_RDONLY);
+        if (sd->input_fd < 0)
+            fatal("Cannot open %s: %s", opts->input_path, strerror(errno));
+        CHECK_ERRNO(fstat(sd->input_fd, &st));
+
+        if (S_ISREG(st.st_mode)) {
+            if (opts->byte_rate == 0)
+                fatal("Sending a file (-i) requires a rate (-r or -s)");
+
+            sd->input_map = map_file(sd->input_fd, opts->input_path,
+                                     &sd->input_size);
+            CHECK_ERRNO(close(sd->input_fd));
+            sd->input_fd = -1;
+        } else if (sd->loop)
+            fatal("Cannot loop (-l) over a stream: %s", opts->input_path);
+    }
+
+    if (sd->input_map) {
+        sd->input_packs = sd->input_size / sd->psize;
+        if (sd->input_packs == 0)
+            fatal("Input file shorter than a pack: %s", opts->input_path);
+
+        // Retransmissions are served straight from the file.
+        if (opts->rexmit_path[0] != '\0' || opts->max_fsize > 0)
+            fatal("Packs of a file input are retransmitted from it, not "
+                  "from a FIFO (-F, -x)");
+        sd->rq = rq_init_mapped(sd->psize, sd->input_map, sd->input_packs);
+    } else if (opts->rexmit_path[0] != '\0') {
+        if (opts->max_fsize > 0)
+            fatal("FIFO kept in a file (-F) cannot be resized (-x)");
+        sd->rq = rq_init_file(sd->psize, sd->fsize,
+                              opts->input_queue + sd->batch_size + 1,
+                              opts->rexmit_path, &sd->session_id);
+    } else if (opts->max_fsize > 0)
+        sd->rq = rq_init_adaptive(sd->psize, sd->fsize, opts->max_fsize,
+                                  opts->input_queue + sd->batch_size + 1);
+    else
+        // Packs are read into the queue and committed once their batch is
+        // sent. Besides the ones in the input ring and in the batch, the
+        // reader holds one more slot while reading.
+        sd->rq = rq_init(sd->psize, sd->fsize,
+                         opts->input_queue + sd->batch_size + 1);
+
+    sd->pacer = NULL;
+    if (opts->byte_rate > 0) {
+        sd->pacer = malloc(sizeof(pacer));
+        if (!sd->pacer)
+            fatal("malloc");
+        // A full batch may go out at once.
+        pacer_init(sd->pacer, opts->byte_rate, sd->batch_size * sd->psize);
+    }
+
+    sd->rexmit_pacer = NULL;
+    if (opts->rexmit_budget > 0) {
+        sd->rexmit_pacer = malloc(sizeof(pacer));
+        if (!sd->rexmit_pacer)
+            fatal("malloc");
+        pacer_init(sd->rexmit_pacer,
+                   max(opts->byte_rate * opts->rexmit_budget / 100, 1UL),
+                   sd->batch_size * sd->psize);
+    }
+
+    if (sd->unicast_threshold > 0)
+        rq_track_requesters(sd->rq);
+
+    sd->zt = NULL;
+    if (opts->zerocopy)
+        sd->zt = zt_init(sd->mcast_send_sock_fd, rq_n_slots(sd->rq));
 
     sd->opts = opts;
 
@@ -73,41 +886,33 @@ inline static sender_data *sd_init(int argc, char **argv) {
 
 inline static void sd_free(sender_data *sd) {
     CHECK_ERRNO(close(sd->mcast_send_sock_fd));
-    free(sd->send_buffer);
+    CHECK_ERRNO(close(sd->finish_fd));
+    if (sd->zt)
+        zt_free(sd->zt);
+    rq_free(sd->rq);
+    free(sd->pacer);
+    free(sd->rexmit_pacer);
+    if (sd->ir)
+        ir_free(sd->ir);
+    if (sd->input_map)
+        CHECK_ERRNO(munmap(sd->input_map, sd->input_size));
+    else if (sd->input_fd != STDIN_FILENO)
+        CHECK_ERRNO(close(sd->input_fd));
     free(sd->opts);
     free(sd);
 }
 
 
-inline static size_t read_pack(FILE *stream, uint64_t pack_size, byte *data) {
-    return fread(data, sizeof(byte), pack_size, stream);
-}
-
-inline static void send_pack(int socket_fd, const struct sockaddr_in
-*dest_address,
-                             const struct audio_pack *pack, sender_data *sd) {
-    socklen_t address_length = (socklen_t) sizeof(*dest_address);
-    int flags = 0;
-
-    ssize_t data_size = sd->psize + 16;
-
-    memset(sd->send_buffer, 0, data_size);
-
-    memcpy(sd->send_buffer, &pack->session_id, 8);
-    memcpy(sd->send_buffer + 8, &pack->first_byte_num, 8);
-    memcpy(sd->send_buffer + 16, pack->audio_data, sd->psize);
-
-    ssize_t sent_size = sendto(socket_fd, sd->send_buffer, data_size, flags,
-                               (struct sockaddr *) dest_address,
-                               address_length);
-
-    ENSURE(sent_size == data_size);
-}
-
 inline static void mark_finished(sender_data *sd) {
     CHECK_ERRNO(pthread_mutex_lock(&sd->mutex));
     sd->finished = true;
     CHECK_ERRNO(pthread_mutex_unlock(&sd->mutex));
+
+    // Wakes the retransmitter waiting for requests, the control listeners
+    // and the stats reporter; the latter never read finish_fd, so it stays
+    // readable.
+    CHECK_ERRNO(eventfd_write(rq_request_fd(sd->rq), 1));
+    CHECK_ERRNO(eventfd_write(sd->finish_fd, 1));
 }
 
 inline static bool is_finished(sender_data *sd) {
@@ -118,4 +923,110 @@ inline static bool is_finished(sender_data *sd) {
     return res;
 }
 
+/**
+ * Splits @p line in place into arguments separated by whitespace. Parts of
+ * an argument may be quoted with '"' or '\'' to include whitespace.
+ * @param line - line to split
+ * @param args - array for pointers to the arguments
+ * @param max_args - size of @p args
+ * @returns number of arguments; -1 if there are more than @p max_args or
+ * a quote is left open
+ */
+inline static int split_args(char *line, char **args, int max_args) {
+    char *r = line;
+    char *w = line;
+    char quote;
+    bool end = false;
+    int n = 0;
+
+    while (!end) {
+        while (isspace(*r))
+            r++;
+        if (*r == '\0')
+            break;
+        if (n == max_args)
+            return -1;
+
+        args[n++] = w;
+        quote = '\0';
+        while (*r != '\0' && (quote || !isspace(*r))) {
+            if (quote && *r == quote)
+                quote = '\0';
+            else if (!quote && (*r == '"' || *r == '\''))
+                quote = *r;
+            else
+                *w++ = *r;
+            r++;
+        }
+        if (quote)
+            return -1;
+
+        end = *r == '\0';
+        if (!end)
+            r++;
+        *w++ = '\0';
+    }
+
+    return n;
+}
+
+/**
+ * Sets up stations listed in the file at @p path, each described by
+ * sender options in a line of its own. Empty lines and lines starting with
+ * '#' are skipped. Stations are served by a single event loop, so their
+ * packs do not go through input rings.
+ * @param path - path to the stations file
+ * @param n_stations - pointer to the number of stations set up
+ * @returns array of the stations
+ */
+inline static sender_data **read_stations(const char *path,
+                                          uint64_t *n_stations) {
+    char *args[MAX_STATION_ARGS + 1];
+    char arg0[] = "sikradio-sender";
+    char *line = NULL;
+    size_t line_size = 0;
+    uint64_t line_num = 0;
+    sender_data **stations = NULL;
+    sender_opts *opts;
+    int n_args;
+
+    FILE *file = fopen(path, "r");
+    if (!file)
+        fatal("Cannot open %s: %s", path, strerror(errno));
+
+    *n_stations = 0;
+    while (getline(&line, &line_size, file) != -1) {
+        line_num++;
+        n_args = split_args(line, args + 1, MAX_STATION_ARGS);
+        if (n_args < 0)
+            fatal("%s:%lu: malformed station", path, line_num);
+        if (n_args == 0 || args[1][0] == '#')
+            continue;
+
+        args[0] = arg0;
+        optind = 1;
+        opts = get_sender_opts(n_args + 1, args);
+        if (opts->stations_path[0] != '\0')
+            fatal("%s:%lu: stations cannot be nested", path, line_num);
+        if (opts->input_path[0] == '\0')
+            fatal("%s:%lu: station needs an input (-i)", path, line_num);
+        opts->input_queue = 0;
+
+        stations = realloc(stations, (*n_stations + 1) * sizeof(*stations));
+        if (!stations)
+            fatal("malloc");
+        // Stations started within the same second still differ.
+        stations[*n_stations] = sd_init(opts, time(NULL) + *n_stations);
+        (*n_stations)++;
+    }
+
+    free(line);
+    CHECK_ERRNO(fclose(file));
+
+    if (*n_stations == 0)
+        fatal("No stations in %s", path);
+
+    return stations;
+}
+
 #endif //_SENDER_UTILS_